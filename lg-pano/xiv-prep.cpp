@@ -0,0 +1,504 @@
+// xiv-prep converts images to xiv pyramids (see xiv_pyramid.h) which xiv maps and shows
+// without decoding them. Images are converted in parallel, one per thread.
+#include "config.h"
+#include "xiv_readers.h"
+#include "xiv_utils.h"
+#include "xiv_pyramid.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#ifdef HAVE_LIBLZ4
+#include <lz4.h>
+#endif
+
+// Used by the readers
+bool verbose = false;
+int loadThreads = 1;
+
+static const char *outDir = 0;	// Pyramids are written next to the images if not set
+static int tileSize = 256;
+static int compression = PYRAMID_RAW;
+static bool force = false;
+
+// Images to convert, taken in turn by the threads
+static char **files = 0;
+static int nbfiles = 0;
+static int nextFile = 0;
+static int nbErrors = 0;
+static pthread_mutex_t mutexFiles = PTHREAD_MUTEX_INITIALIZER;
+
+void usage(const char *name)
+{
+	fprintf(stderr, "xiv-prep %s\n", VERSION);
+	fprintf(stderr, "Usage: %s [options] file|directory...\n", name);
+	fprintf(stderr, "Converts PPM, JPEG and TIFF images to xiv pyramids (.xivp) which xiv opens without decoding.\n");
+	fprintf(stderr, "Every image of a directory is converted.\n");
+	fprintf(stderr, "   -o dir Directory of the pyramids (default is the directory of each image).\n");
+	fprintf(stderr, "   -lz4 Compress tiles with LZ4 (default is raw tiles).\n");
+	fprintf(stderr, "   -tile # Size of tiles (default 256).\n");
+	fprintf(stderr, "   -threads # Images converted at the same time (default is the number of cores).\n");
+	fprintf(stderr, "   -f Convert images even if their pyramid is more recent.\n");
+	fprintf(stderr, "   -v Verbose.\n");
+}
+
+// Name of the pyramid of file: .xivp is appended, so that a.jpg and a.tif get different ones
+char *pyramid_name(const char *file)
+{
+	char *tmp = strdup(file);
+	const char *dir = outDir ? outDir : dirname(tmp);
+	const char *base = strrchr(file, '/') ? strrchr(file, '/') + 1 : file;
+	char *name = (char *)malloc(strlen(dir) + strlen(base) + 7);
+	sprintf(name, "%s/%s.xivp", dir, base);
+	free(tmp);
+	return name;
+}
+
+// Pyramid names followed by the index of their image, the first image first
+static int cmp_names(const void *p1, const void *p2)
+{
+	const char *n1 = *(char *const *)p1, *n2 = *(char *const *)p2;
+	int c = strcmp(n1, n2);
+	return c ? c : atoi(n1 + strlen(n1) + 1) - atoi(n2 + strlen(n2) + 1);
+}
+
+// Skip the images whose pyramid has the name of the pyramid of another one, e.g. images
+// of the same name in two directories converted to the same -o directory. Their threads
+// would write the same file.
+void drop_collisions()
+{
+	// Pyramid name of each file followed by its index
+	char **names = (char **)malloc(nbfiles * sizeof(char *));
+	if (names == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		exit(1);
+	}
+	for (int i = 0; i < nbfiles; i++) {
+		char *name = pyramid_name(files[i]);
+		names[i] = (char *)malloc(strlen(name) + 12);
+		sprintf(names[i], "%s%c%d", name, 0, i);
+		free(name);
+	}
+	qsort(names, nbfiles, sizeof(char *), cmp_names);
+	int kept = 0;
+	for (int i = 0; i < nbfiles; i++) {
+		if (i > 0 && strcmp(names[i], names[kept]) == 0) {
+			int a = atoi(names[kept] + strlen(names[kept]) + 1);
+			int b = atoi(names[i] + strlen(names[i]) + 1);
+			fprintf(stderr, "%s and %s have the same pyramid %s, %s is skipped\n",
+				files[a], files[b], names[i], files[b]);
+			free(files[b]);
+			files[b] = 0;
+			nbErrors++;
+		} else
+			kept = i;
+	}
+	for (int i = 0; i < nbfiles; i++)
+		free(names[i]);
+	free(names);
+	int n = 0;
+	for (int i = 0; i < nbfiles; i++) {
+		if (files[i])
+			files[n++] = files[i];
+	}
+	nbfiles = n;
+}
+
+// Assemble the tiles of an image read by tiles in a single raster
+unsigned char *read_tiles(Tiles * tiles)
+{
+	size_t pix = (size_t)3 * tiles->nb;
+	unsigned char *buf = (unsigned char *)malloc((size_t)tiles->w * tiles->h * pix);
+	unsigned char *tile = (unsigned char *)malloc(tiles->tileBytes);
+	bool ok = buf && tile;
+	for (int ty = 0; ok && ty < tiles->ny; ty++) {
+		for (int tx = 0; ok && tx < tiles->nx; tx++) {
+			ok = tiles->src->read(0, 0, tx, ty, tile);
+			int rows = tiles->h - ty * tiles->th < tiles->th ? tiles->h - ty * tiles->th : tiles->th;
+			int cols = tiles->w - tx * tiles->tw < tiles->tw ? tiles->w - tx * tiles->tw : tiles->tw;
+			for (int i = 0; ok && i < rows; i++)
+				memcpy(buf + ((size_t)(ty * tiles->th + i) * tiles->w + tx * tiles->tw) * pix,
+				       tile + (size_t)i * tiles->tw * pix, cols * pix);
+		}
+	}
+	free(tile);
+	if (!ok) {
+		free(buf);
+		return 0;
+	}
+	return buf;
+}
+
+// Read file as 8 or 16 bits RGB, mapped when possible
+unsigned char *read_raster(const struct image_file &file, int &w, int &h,
+			   int &nb, int &max, void *&map, size_t &mapLen)
+{
+	unsigned char *buf = 0;
+	nb = 1;
+	max = 255;
+	switch (file.format) {
+	case IMAGE_PPM:
+		buf = map_ppm(file, w, h, map, mapLen);
+		if (buf == 0)
+			buf = read_ppm(file, w, h, nb, max);
+		break;
+	case IMAGE_JPEG:
+		buf = read_jpeg(file, w, h);
+		break;
+	case IMAGE_TIFF:
+		buf = map_tiff(file, w, h, map, mapLen);
+		if (buf == 0)
+			buf = read_tiff(file, w, h, nb, max);
+		// Tiled tiff
+		if (buf == 0) {
+			Tiles *tiles = open_tiff_tiles(file, w, h, nb, max, 0);
+			if (tiles) {
+				buf = read_tiles(tiles);
+				delete tiles;
+			}
+		}
+		break;
+	case IMAGE_PNG:
+		buf = read_png(file, w, h, nb, max);
+		break;
+	}
+	return buf;
+}
+
+// Rotate a raster as its EXIF orientation tells, see read_orientation().
+// Returns a new raster, 0 if not rotated or out of memory.
+unsigned char *rotate_raster(const unsigned char *in, int &w, int &h, int nb,
+			     int ai)
+{
+	if (ai == 0)
+		return 0;
+	size_t pix = (size_t)3 * nb;
+	unsigned char *out = (unsigned char *)malloc((size_t)w * h * pix);
+	if (out == NULL)
+		return 0;
+	int ow = ai == 2 ? w : h, oh = ai == 2 ? h : w;
+	for (int y = 0; y < oh; y++) {
+		unsigned char *o = out + (size_t)y * ow * pix;
+		for (int x = 0; x < ow; x++, o += pix) {
+			int i, j;
+			if (ai == 1) {	// 90 counter clockwise
+				i = x;
+				j = w - 1 - y;
+			} else if (ai == 2) {	// 180
+				i = h - 1 - y;
+				j = w - 1 - x;
+			} else {	// 90 clockwise
+				i = h - 1 - x;
+				j = y;
+			}
+			memcpy(o, in + ((size_t)i * w + j) * pix, pix);
+		}
+	}
+	w = ow;
+	h = oh;
+	return out;
+}
+
+inline unsigned int get_sample(const unsigned char *p, int nb, size_t k)
+{
+	return nb == 1 ? p[k] : ((const unsigned short *)p)[k];
+}
+
+inline void set_sample(unsigned char *p, int nb, size_t k, unsigned int v)
+{
+	if (nb == 1)
+		p[k] = v;
+	else
+		((unsigned short *)p)[k] = v;
+}
+
+// Next level of a pyramid, each pixel is the mean of 2x2 pixels.
+// On odd sizes the last row or column is averaged with itself.
+unsigned char *reduce_raster(const unsigned char *in, int w, int h, int nb)
+{
+	int rw = (w + 1) / 2, rh = (h + 1) / 2;
+	unsigned char *out = (unsigned char *)malloc((size_t)rw * rh * 3 * nb);
+	if (out == NULL)
+		return 0;
+	for (int y = 0; y < rh; y++) {
+		size_t r0 = (size_t)(2 * y) * w * 3;
+		size_t r1 = (size_t)(2 * y + 1 < h ? 2 * y + 1 : 2 * y) * w * 3;
+		for (int x = 0; x < rw; x++) {
+			size_t c0 = (size_t)(2 * x) * 3;
+			size_t c1 = (size_t)(2 * x + 1 < w ? 2 * x + 1 : 2 * x) * 3;
+			for (int c = 0; c < 3; c++) {
+				unsigned int s = get_sample(in, nb, r0 + c0 + c)
+				    + get_sample(in, nb, r0 + c1 + c)
+				    + get_sample(in, nb, r1 + c0 + c)
+				    + get_sample(in, nb, r1 + c1 + c);
+				set_sample(out, nb, ((size_t)y * rw + x) * 3 + c, (s + 2) / 4);
+			}
+		}
+	}
+	return out;
+}
+
+// Write the pyramid of a raster to file, returns false on error
+bool write_pyramid(const char *file, const unsigned char *raster, int w, int h,
+		   int nb, int max)
+{
+	struct pyramid_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PYRAMID_MAGIC, sizeof(hdr.magic));
+	hdr.order = PYRAMID_ORDER;
+	hdr.w = w;
+	hdr.h = h;
+	hdr.tw = hdr.th = tileSize;
+	hdr.nb = nb;
+	hdr.compression = compression;
+	hdr.max = max;
+	hdr.levels = 1;
+	while (pyramid_side(w, hdr.levels - 1) > 1 || pyramid_side(h, hdr.levels - 1) > 1)
+		hdr.levels++;
+	size_t n = 0;
+	for (uint32_t l = 0; l < hdr.levels; l++)
+		n += (size_t)((pyramid_side(w, l) + tileSize - 1) / tileSize)
+		    * ((pyramid_side(h, l) + tileSize - 1) / tileSize);
+
+	size_t pix = (size_t)3 * nb;
+	size_t tileBytes = (size_t)tileSize * tileSize * pix;
+	struct pyramid_tile *index =
+	    (struct pyramid_tile *)calloc(n, sizeof(struct pyramid_tile));
+	unsigned char *tile = (unsigned char *)malloc(tileBytes);
+	char *packed = 0;
+#ifdef HAVE_LIBLZ4
+	if (compression == PYRAMID_LZ4)
+		packed = (char *)malloc(LZ4_compressBound((int)tileBytes));
+#endif
+	FILE *f = fopen(file, "wb");
+	bool ok = index && tile && (compression == PYRAMID_RAW || packed) && f
+	    && fwrite(&hdr, sizeof(hdr), 1, f) == 1
+	    && fwrite(index, sizeof(struct pyramid_tile), n, f) == n;
+	uint64_t offset = sizeof(hdr) + n * sizeof(struct pyramid_tile);
+
+	const unsigned char *level = raster;
+	size_t k = 0;
+	for (uint32_t l = 0; ok && l < hdr.levels; l++) {
+		int lw = pyramid_side(w, l), lh = pyramid_side(h, l);
+		for (int ty = 0; ok && ty * tileSize < lh; ty++) {
+			for (int tx = 0; ok && tx * tileSize < lw; tx++, k++) {
+				// Padding is left black, it compresses best
+				int rows = lh - ty * tileSize < tileSize ? lh - ty * tileSize : tileSize;
+				int cols = lw - tx * tileSize < tileSize ? lw - tx * tileSize : tileSize;
+				if (rows < tileSize || cols < tileSize)
+					memset(tile, 0, tileBytes);
+				for (int i = 0; i < rows; i++)
+					memcpy(tile + i * tileSize * pix,
+					       level + ((size_t)(ty * tileSize + i) * lw + tx * tileSize) * pix,
+					       cols * pix);
+				const void *data = tile;
+				size_t len = tileBytes;
+#ifdef HAVE_LIBLZ4
+				if (compression == PYRAMID_LZ4) {
+					int packedLen = LZ4_compress_default((const char *)tile, packed, (int)tileBytes,
+									     LZ4_compressBound((int)tileBytes));
+					if (packedLen > 0 && (size_t)packedLen < tileBytes) {
+						data = packed;
+						len = packedLen;
+					}
+				}
+#endif
+				index[k].offset = offset;
+				index[k].len = len;
+				ok = fwrite(data, len, 1, f) == 1;
+				offset += len;
+			}
+		}
+		// Only the level being written and the next one are kept
+		if (ok && l + 1 < hdr.levels) {
+			unsigned char *next = reduce_raster(level, lw, lh, nb);
+			if (level != raster)
+				free((void *)level);
+			level = next;
+			ok = next != 0;
+		}
+	}
+	if (level != raster)
+		free((void *)level);
+	ok = ok && fseek(f, sizeof(hdr), SEEK_SET) == 0
+	    && fwrite(index, sizeof(struct pyramid_tile), n, f) == n;
+	if (f && fclose(f) != 0)
+		ok = false;
+	free(index);
+	free(tile);
+	free(packed);
+	return ok;
+}
+
+// Convert file to a pyramid, returns false on error
+bool convert(const char *file)
+{
+	char *name = pyramid_name(file);
+	struct stat in, out;
+	if (!force && stat(file, &in) == 0 && stat(name, &out) == 0
+	    && out.st_mtime >= in.st_mtime) {
+		if (verbose)
+			fprintf(stderr, "%s is up to date\n", name);
+		free(name);
+		return true;
+	}
+	int w, h, nb, max;
+	void *map = 0;
+	size_t mapLen = 0;
+	struct image_file f;
+	unsigned char *buf = 0;
+	int ai = 0;
+	if (open_image_file(file, f)) {
+		buf = read_raster(f, w, h, nb, max, map, mapLen);
+		ai = read_orientation(f);
+		close_image_file(f);
+	}
+	if (buf == 0) {
+		fprintf(stderr, "Can't read %s\n", file);
+		free(name);
+		return false;
+	}
+	if (max <= 0)
+		max = nb == 2 ? 65535 : 255;
+	unsigned char *rotated = rotate_raster(buf, w, h, nb, ai);
+	// Written under a temporary name so that xiv never sees a partial pyramid, unique so that
+	// another xiv-prep converting the same image doesn't write it too
+	char *tmp = (char *)malloc(strlen(name) + 32);
+	sprintf(tmp, "%s.%d.%lu.tmp", name, (int)getpid(), (unsigned long)pthread_self());
+	bool ok = write_pyramid(tmp, rotated ? rotated : buf, w, h, nb, max)
+	    && rename(tmp, name) == 0;
+	if (ok && verbose)
+		fprintf(stderr, "%s -> %s %d x %d\n", file, name, w, h);
+	if (!ok) {
+		fprintf(stderr, "Can't write %s\n", name);
+		unlink(tmp);
+	}
+	free(rotated);
+	if (map)
+		munmap(map, mapLen);
+	else
+		free(buf);
+	free(tmp);
+	free(name);
+	return ok;
+}
+
+void *convert_files(void *arg)
+{
+	for (;;) {
+		pthread_mutex_lock(&mutexFiles);
+		int i = nextFile < nbfiles ? nextFile++ : -1;
+		pthread_mutex_unlock(&mutexFiles);
+		if (i < 0)
+			break;
+		if (!convert(files[i])) {
+			pthread_mutex_lock(&mutexFiles);
+			nbErrors++;
+			pthread_mutex_unlock(&mutexFiles);
+		}
+	}
+	return 0;
+}
+
+void add_file(const char *file)
+{
+	files = (char **)realloc(files, (nbfiles + 1) * sizeof(char *));
+	if (files == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		exit(1);
+	}
+	files[nbfiles++] = strdup(file);
+}
+
+// Add every image of a directory, pyramids excepted
+void add_directory(const char *path)
+{
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		fprintf(stderr, "Can't open %s\n", path);
+		nbErrors++;
+		return;
+	}
+	for (struct dirent * dirent; (dirent = readdir(dir)) != NULL;) {
+		size_t len = strlen(dirent->d_name);
+		if (dirent->d_name[0] == '.'
+		    || (len > 5 && strcmp(dirent->d_name + len - 5, ".xivp") == 0))
+			continue;
+		char *file = (char *)malloc(strlen(path) + len + 2);
+		sprintf(file, "%s/%s", path, dirent->d_name);
+		if (is_file(file))
+			add_file(file);
+		free(file);
+	}
+	closedir(dir);
+}
+
+int main(int argc, char **argv)
+{
+	int nthreads = 0;
+	for (int i = 1; i < argc; i++) {
+		if (0 == strcmp(argv[i], "-o") && i + 1 < argc)
+			outDir = argv[++i];
+		else if (0 == strcmp(argv[i], "-lz4")) {
+#ifdef HAVE_LIBLZ4
+			compression = PYRAMID_LZ4;
+#else
+			fprintf(stderr, "LZ4 isn't available\n");
+			exit(1);
+#endif
+		} else if (0 == strcmp(argv[i], "-tile")) {
+			if (i + 1 >= argc || sscanf(argv[++i], "%d", &tileSize) != 1
+			    || tileSize < 16 || tileSize > 4096) {
+				usage(argv[0]);
+				exit(1);
+			}
+		} else if (0 == strcmp(argv[i], "-threads")) {
+			if (i + 1 >= argc || sscanf(argv[++i], "%d", &nthreads) != 1
+			    || nthreads < 1) {
+				usage(argv[0]);
+				exit(1);
+			}
+		} else if (0 == strcmp(argv[i], "-f"))
+			force = true;
+		else if (0 == strcmp(argv[i], "-v"))
+			verbose = true;
+		else if (argv[i][0] == '-') {
+			usage(argv[0]);
+			exit(1);
+		} else {
+			struct stat st;
+			if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+				add_directory(argv[i]);
+			else
+				add_file(argv[i]);
+		}
+	}
+	if (nbfiles == 0) {
+		usage(argv[0]);
+		exit(1);
+	}
+	drop_collisions();
+	if (nthreads == 0)
+		nthreads = count_cpus();
+	if (nthreads > nbfiles)
+		nthreads = nbfiles;
+	pthread_t *th = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+	int started = 0;
+	for (int i = 0; i < nthreads && th; i++) {
+		if (pthread_create(th + i, NULL, convert_files, NULL) == 0)
+			started++;
+	}
+	// Convert in this thread if no thread could be created
+	if (started == 0)
+		convert_files(NULL);
+	for (int i = 0; i < started; i++)
+		pthread_join(th[i], NULL);
+	free(th);
+	return nbErrors ? 1 : 0;
+}
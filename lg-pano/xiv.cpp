@@ -44,9 +44,12 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <signal.h>
 #include "xiv.h"
 #include "xiv_utils.h"
 #include "xiv_readers.h"
+#include "xiv_shared.h"
+#include "xiv_disk.h"
 #include "read-event.h"
 
 #define MAX_SLAVES 30
@@ -80,7 +83,13 @@ pthread_t thFifo;         // Pipe control thread
 pthread_t thSpacenav;     // Spacenav control thread
 pthread_t thUDPSlave;     // UDP slave control thread
 pthread_t thUDPMaster;    // UDP master control thread
-pthread_t thPreload;      // Preload image thread
+pthread_t *thPreload = 0; // Prefetch workers
+pthread_t thDisplay;      // Image switching thread
+pthread_t thSignals;      // Exits on exitSignals
+pthread_t thStore;        // Writes decoded images to diskCache
+pthread_t thPack;         // Compresses the images out of the prefetch window
+pthread_t thUpgrade;      // Decodes the current image at full resolution
+sigset_t exitSignals;
 
 #ifdef WATCHDOG
 pthread_t thWatchdog;     // Watchdog to restart thFill if needed
@@ -112,18 +121,62 @@ int osdSize = 256;
 // Position buffer
 typedef struct {
     float dx, dy, z, a;
+    int lu, cr;
+    float gm;
+    bool revert;
     Image *imgCurrent;
+    int scale;            // Raster reduction of imgCurrent
+    bool proxy;           // Draw the 8 bits proxy of imgCurrent
+    int sw, sh;           // Size of the reduced image
 } pos_buf;
 pos_buf fillState;
 
 // Current image
 Image *imgCurrent = 0;
 
-// Image cache
-int CACHE_NBIMAGES = 5;
+// Image cache, the least recently used images which aren't held are evicted
+// when it holds more than cacheBytes bytes or CACHE_NBIMAGES images
+int CACHE_NBIMAGES = 32;
+size_t cacheBytes = 0;    // 0 for half of the memory
+bool sharedCache = false; // Share decoded rasters with the other xiv of the node, see xiv_shared.h
+bool packCache = true;    // Compress the images out of the prefetch window, see async_pack()
+const char *diskCache = 0;    // Directory of the rasters kept for the next runs, see xiv_disk.h
+size_t diskBytes = (size_t)4096 << 20;
 pthread_mutex_t mutexCache = PTHREAD_MUTEX_INITIALIZER;    // Mutex protecting the cache
-Image **imgCache;
-int idxCache = 0;
+pthread_cond_t condCache = PTHREAD_COND_INITIALIZER;       // Signaled when a load ends
+Image *cacheFirst = 0;    // Most recently used image
+char *wantedFile = 0;    // Image shown by the last display_image(), loads of others are cancelled
+bool displayPending = false;                           // wantedFile waits for async_display()
+bool displayStopped = false;                           // async_display() ended, see stop_display()
+pthread_cond_t condDisplay = PTHREAD_COND_INITIALIZER; // Signaled by display_image()
+
+// Image asked for by display_image() and not shown yet, under mutexData. The positions the sync
+// slave and the fifo receive meanwhile are for it: they are kept and applied by show_image()
+// once it's fitted, rather than moving the image still shown.
+char *loadingFile = 0;
+bool posPending = false;    // Last position from the master
+float posDx, posDy, posZ;
+char **movesPending = 0;    // Moves from the fifo, in order
+int movesLen = 0;
+pthread_cond_t condUpgrade = PTHREAD_COND_INITIALIZER; // Signaled when the current image may want an upgrade
+
+// Prefetching: workers load the window of images around the current one, prefetchAhead in the
+// browse direction and prefetchBehind in the other one, the nearest first (see update_window())
+int prefetchAhead = 3;
+int prefetchBehind = 1;
+int prefetchThreads = 2;
+pthread_cond_t condPrefetch = PTHREAD_COND_INITIALIZER;    // Signaled when the window changes
+int *prefetchWindow = 0;    // Indices in files of the window, the current image first
+int prefetchLen = 0;
+int browseDir = 1;          // Direction of the last step through the files
+int windowIdx = -1;         // idxfile the window was computed for
+char **prefetching;         // File loaded by each worker
+
+// Images decoded by this process, held until async_store() writes their raster to diskCache
+#define STORE_QUEUE 8
+Image *storeQueue[STORE_QUEUE];
+int storeLen = 0;
+pthread_cond_t condStore = PTHREAD_COND_INITIALIZER;    // Signaled when an image is queued
 
 // FIFO file name
 char *fifo = NULL;
@@ -155,6 +208,56 @@ int nbfiles = 0;
 int idxfile = 0;
 bool shuffle = false;
 
+// View, radiometry and current image. The globals are changed under mutexData and published
+// by unlock_view(), the drawing and sync threads read consistent snapshots of them without
+// locking with read_view(): a seqlock, viewSeq is odd while viewShared is written.
+typedef struct {
+    float dx, dy, z, a;
+    int lu, cr;
+    float gm;
+    bool revert;
+    Image *img;
+    int idx;
+} view_state;
+view_state viewShared;
+unsigned int viewSeq = 0;
+
+// Publish the view and unlock mutexData, locked by the caller to change it
+void unlock_view()
+{
+    unsigned int seq = viewSeq;
+    __atomic_store_n(&viewSeq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    viewShared.dx = dx;
+    viewShared.dy = dy;
+    viewShared.z = z;
+    viewShared.a = a;
+    viewShared.lu = lu;
+    viewShared.cr = cr;
+    viewShared.gm = gm;
+    viewShared.revert = revert;
+    viewShared.img = imgCurrent;
+    viewShared.idx = idxfile;
+    __atomic_store_n(&viewSeq, seq + 2, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mutexData);
+}
+
+// Snapshot of the view last published by unlock_view().
+// A reader spinning at real time priority (see -syncprio) would keep a writer preempted on its
+// core from finishing, it sleeps after a few spins. It can't lock mutexData instead, readers
+// may hold mutexCache.
+void read_view(view_state &v)
+{
+    unsigned int seq;
+    do {
+        for (int spins = 0; (seq = __atomic_load_n(&viewSeq, __ATOMIC_ACQUIRE)) & 1; spins++)
+            if (spins >= 100)
+                usleep(10);
+        memcpy(&v, &viewShared, sizeof(v));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&viewSeq, __ATOMIC_RELAXED) != seq);
+}
+
 // Control
 bool h360 = false;
 bool spacenav = false;
@@ -188,6 +291,14 @@ float powe = 0;
 int ncores = 0;
 int *fillBounds = NULL;
 
+// CPU placement and scheduling
+cpu_set_t fillCpus;            // Cores fill workers are pinned to, empty means no pinning
+cpu_set_t loadCpus;            // Cores the prefetch workers are confined to
+int loadThreads = 0;           // Threads decoding one image, 0 for the number of cores
+size_t virtualMin = 0;         // Images bigger than this once decoded are read by tiles, 0 for memory_limit()/4
+pthread_attr_t *fillAttr = NULL;
+int syncPrio = 0;              // >0 SCHED_FIFO priority, <0 nice value for sync and input threads
+
 // Zoom on zone
 int zx1 = 0, zx2 = 0, zy1 = 0, zy2 = 0;
 bool displayZone = false;
@@ -204,6 +315,10 @@ int ncells = 12;
 
 bool verbose = false;
 
+bool roi = false;                 // Only decode the part of JPEG images this window can show
+bool needRes = false;             // Decode images no finer than the window shows, see need_scale()
+bool preview = true;              // Show big JPEG images reduced while they are decoded
+
 bool displayAbout = false;
 const char *about = " xiv " VERSION " (c) Gilles BERNARD lordikc@free.fr ";
 
@@ -216,8 +331,24 @@ void usage(const char *prog)
     fprintf(stderr, "   -geometry widthxheight+ox+oy, default is screen size\n");
     fprintf(stderr, "   -fakewin Don't create a window, but do pretend to have a window (must specify -geometry)\n");
     fprintf(stderr, "   -threads # threads, default is to auto-detect # of cores.\n");
-    fprintf(stderr, "   -cache # images (default 5).\n");
+    fprintf(stderr, "   -fillcpus <list> pin drawing threads to these cores, e.g. 0-3,6, default is no pinning. Sets the default number of drawing threads.\n");
+    fprintf(stderr, "   -loadcpus <list> confine image decoding in the background to these cores.\n");
+    fprintf(stderr, "   -loadthreads # threads decoding one JPEG image with restart markers, default is the number of cores.\n");
+    fprintf(stderr, "   -syncprio ## priority of sync and input threads: >0 real-time (SCHED_FIFO) priority, <0 nice value.\n");
+    fprintf(stderr, "   -prefetch ahead[,behind] images loaded in the background around the current one (default 3,1).\n");
+    fprintf(stderr, "   -prefetchthreads # threads loading images in the background (default 2).\n");
+    fprintf(stderr, "   -cache # images at most (default 32).\n");
+    fprintf(stderr, "   -cachemem # MB of decoded images kept in the cache (default is half of the memory).\n");
+    fprintf(stderr, "   -no-pack Don't compress the cached images which are out of the prefetch window.\n");
+    fprintf(stderr, "   -shared decoded images with the other xiv of the node (in /dev/shm).\n");
+    fprintf(stderr, "   -diskcache <dir> keep decoded images in this directory for the next runs of xiv.\n");
+    fprintf(stderr, "   -diskcachemem # MB of decoded images kept in the -diskcache directory (default 4096).\n");
+    fprintf(stderr, "   -tilecache # MB of decoded tiles kept for all images read by tiles (default 256).\n");
+    fprintf(stderr, "   -virtual # MB, images bigger than this once decoded are read by tiles (default is a quarter of the memory).\n");
+    fprintf(stderr, "   -screenres decode images no finer than the window shows at the maximum zoom.\n");
+    fprintf(stderr, "   -roi only decode the part of JPEG images this window shows, the rest is decoded when the view leaves it.\n");
     fprintf(stderr, "   -no-autorot Disable auto rotate according to EXIF tags.\n");
+    fprintf(stderr, "   -no-preview Don't show a reduced version of big JPEG images while they are decoded.\n");
     fprintf(stderr, "   -overview Display overview.\n");
     fprintf(stderr, "   -fullscreen.\n");
     fprintf(stderr, "   -histogram Display histogram.\n");
@@ -253,7 +384,7 @@ void usage(const char *prog)
     fprintf(stderr, "As opposed to most of the image viewers, it does not rely on scrollbar for image panning.\n");
     fprintf(stderr, "It is a powerful tool to analyse huge images.\n");
     fprintf(stderr, "The Window is a view of the image in which you can zoom, pan, rotate...\n");
-    fprintf(stderr, "%s reads natively 8 and 16 bits binary PPM and TIFF and JPEG images. It uses ImageMagick to convert other formats.\n", progn);
+    fprintf(stderr, "%s reads natively 8 and 16 bits binary PPM, TIFF and PNG and JPEG images. It uses ImageMagick to convert other formats.\n", progn);
     fprintf(stderr, "Image drawing is performed in several threads for a better image analysis experience.\n");
     fprintf(stderr, "Next image is preloaded during current image analysis.\n");
     fprintf(stderr, "Shortcuts are:\n");
@@ -309,9 +440,7 @@ void usage(const char *prog)
 #ifdef HAVE_LIBTIFF
     fprintf(stderr, "TIFF ");
 #endif
-#ifdef HAVE_LIBEXIF
     fprintf(stderr, "EXIF ");
-#endif
     fprintf(stderr, "\n");
 }
 
@@ -329,250 +458,382 @@ void write_points(const char *file)
 // Return a pixel r,g and b value according to geometric and radiometric transformation.
 // r,g and b are between 0 and 255 even if the input image is 16 bits.
 // contrast, luminosity and gamma take advantage of the 16bits wide input to best convert to 8 bits.
-inline void pixel_gm_nb2(int ii, int ji, int &r, int &g, int &b, Image *img)
+inline void pixel_gm_nb2(const unsigned char *p, int &r, int &g, int &b, Image *img)
 {
-    int idx = 3 * (img->w * ii + ji);
     int val = 0;
 
-    val = *(((unsigned short *)img->buf) + idx);
+    val = ((const unsigned short *)p)[0];
 
-    val = (int)(cr * powv[(val * 255) >> img->nbits]) >> 8;
+    val = (int)(fillState.cr * powv[(val * 255) >> img->nbits]) >> 8;
 
-    val += lu;
+    val += fillState.lu;
 
     if (val > 255)
         val = 255;
     if (val < 0)
         val = 0;
 
-    if (revert)
+    if (fillState.revert)
         val = 255 - val;
 
     b = val;
 
-    val = *(((unsigned short *)img->buf) + idx + 1);
+    val = ((const unsigned short *)p)[1];
 
-    val = (int)(cr * powv[(val * 255) >> img->nbits]) >> 8;
+    val = (int)(fillState.cr * powv[(val * 255) >> img->nbits]) >> 8;
 
-    val += lu;
+    val += fillState.lu;
 
     if (val > 255)
         val = 255;
     if (val < 0)
         val = 0;
 
-    if (revert)
+    if (fillState.revert)
         val = 255 - val;
 
     g = val;
 
-    val = *(((unsigned short *)img->buf) + idx + 2);
+    val = ((const unsigned short *)p)[2];
 
-    val = (int)(cr * powv[(val * 255) >> img->nbits]) >> 8;
+    val = (int)(fillState.cr * powv[(val * 255) >> img->nbits]) >> 8;
 
-    val += lu;
+    val += fillState.lu;
 
     if (val > 255)
         val = 255;
     if (val < 0)
         val = 0;
 
-    if (revert)
+    if (fillState.revert)
         val = 255 - val;
 
     r = val;
 }
 
-inline void pixel_gm_nb1(int ii, int ji, int &r, int &g, int &b, Image *img)
+inline void pixel_gm_nb1(const unsigned char *p, int &r, int &g, int &b, Image *img)
 {
-    int idx = 3 * (img->w * ii + ji);
     int val = 0;
 
-    val = img->buf[idx];
+    val = p[0];
 
-    val = (int)(cr * powv[val]) >> 8;
+    val = (int)(fillState.cr * powv[val]) >> 8;
 
-    val += lu;
+    val += fillState.lu;
 
     if (val > 255)
         val = 255;
     if (val < 0)
         val = 0;
 
-    if (revert)
+    if (fillState.revert)
         val = 255 - val;
 
     b = val;
 
-    val = img->buf[idx + 1];
+    val = p[1];
 
-    val = (int)(cr * powv[val]) >> 8;
+    val = (int)(fillState.cr * powv[val]) >> 8;
 
-    val += lu;
+    val += fillState.lu;
 
     if (val > 255)
         val = 255;
     if (val < 0)
         val = 0;
 
-    if (revert)
+    if (fillState.revert)
         val = 255 - val;
 
     g = val;
 
-    val = img->buf[idx + 2];
+    val = p[2];
 
-    val = (int)(cr * powv[val]) >> 8;
+    val = (int)(fillState.cr * powv[val]) >> 8;
 
-    val += lu;
+    val += fillState.lu;
 
     if (val > 255)
         val = 255;
     if (val < 0)
         val = 0;
 
-    if (revert)
+    if (fillState.revert)
         val = 255 - val;
 
     r = val;
 }
 
-inline void pixel_gm1_nb2(int ii, int ji, int &r, int &g, int &b, Image *img)
+inline void pixel_gm1_nb2(const unsigned char *p, int &r, int &g, int &b, Image *img)
 {
-    int idx = 3 * (img->w * ii + ji);
     int val = 0;
 
-    val = *(((unsigned short *)img->buf) + idx);
+    val = ((const unsigned short *)p)[0];
 
-    val *= cr;
+    val *= fillState.cr;
     val >>= img->nbits;
 
-    val += lu;
+    val += fillState.lu;
 
     if (val > 255)
         val = 255;
     if (val < 0)
         val = 0;
 
-    if (revert)
+    if (fillState.revert)
         val = 255 - val;
 
     b = val;
 
-    val = *(((unsigned short *)img->buf) + idx + 1);
+    val = ((const unsigned short *)p)[1];
 
-    val *= cr;
+    val *= fillState.cr;
     val >>= img->nbits;
 
-    val += lu;
+    val += fillState.lu;
 
     if (val > 255)
         val = 255;
     if (val < 0)
         val = 0;
 
-    if (revert)
+    if (fillState.revert)
         val = 255 - val;
 
     g = val;
 
-    val = *(((unsigned short *)img->buf) + idx + 2);
+    val = ((const unsigned short *)p)[2];
 
-    val *= cr;
+    val *= fillState.cr;
     val >>= img->nbits;
 
-    val += lu;
+    val += fillState.lu;
 
     if (val > 255)
         val = 255;
     if (val < 0)
         val = 0;
 
-    if (revert)
+    if (fillState.revert)
         val = 255 - val;
 
     r = val;
 }
 
-inline void pixel_gm1_nb1(int ii, int ji, int &r, int &g, int &b, Image *img)
+inline void pixel_gm1_nb1(const unsigned char *p, int &r, int &g, int &b, Image *img)
 {
-    int idx = 3 * (img->w * ii + ji);
     int val = 0;
 
-    val = img->buf[idx];
+    val = p[0];
 
-    val *= cr;
+    val *= fillState.cr;
     val >>= img->nbits;
 
-    val += lu;
+    val += fillState.lu;
 
     if (val > 255)
         val = 255;
     if (val < 0)
         val = 0;
 
-    if (revert)
+    if (fillState.revert)
         val = 255 - val;
 
     b = val;
 
-    val = img->buf[idx + 1];
+    val = p[1];
 
-    val *= cr;
+    val *= fillState.cr;
     val >>= img->nbits;
 
-    val += lu;
+    val += fillState.lu;
 
     if (val > 255)
         val = 255;
     if (val < 0)
         val = 0;
 
-    if (revert)
+    if (fillState.revert)
         val = 255 - val;
 
     g = val;
 
-    val = img->buf[idx + 2];
+    val = p[2];
 
-    val *= cr;
+    val *= fillState.cr;
     val >>= img->nbits;
 
-    val += lu;
+    val += fillState.lu;
 
     if (val > 255)
         val = 255;
     if (val < 0)
         val = 0;
 
-    if (revert)
+    if (fillState.revert)
         val = 255 - val;
 
     r = val;
 }
 
+// Gray pixels have a single sample, which is replicated to r, g and b
+inline void pixel_gray_gm_nb2(const unsigned char *p, int &r, int &g, int &b, Image *img)
+{
+    int val = ((const unsigned short *)p)[0];
+
+    val = (int)(fillState.cr * powv[(val * 255) >> img->nbits]) >> 8;
+
+    val += fillState.lu;
+
+    if (val > 255)
+        val = 255;
+    if (val < 0)
+        val = 0;
+
+    if (fillState.revert)
+        val = 255 - val;
+
+    r = g = b = val;
+}
+
+inline void pixel_gray_gm_nb1(const unsigned char *p, int &r, int &g, int &b, Image *img)
+{
+    int val = p[0];
+
+    val = (int)(fillState.cr * powv[val]) >> 8;
+
+    val += fillState.lu;
+
+    if (val > 255)
+        val = 255;
+    if (val < 0)
+        val = 0;
+
+    if (fillState.revert)
+        val = 255 - val;
+
+    r = g = b = val;
+}
+
+inline void pixel_gray_gm1_nb2(const unsigned char *p, int &r, int &g, int &b, Image *img)
+{
+    int val = ((const unsigned short *)p)[0];
+
+    val *= fillState.cr;
+    val >>= img->nbits;
+
+    val += fillState.lu;
+
+    if (val > 255)
+        val = 255;
+    if (val < 0)
+        val = 0;
+
+    if (fillState.revert)
+        val = 255 - val;
+
+    r = g = b = val;
+}
+
+inline void pixel_gray_gm1_nb1(const unsigned char *p, int &r, int &g, int &b, Image *img)
+{
+    int val = p[0];
+
+    val *= fillState.cr;
+    val >>= img->nbits;
+
+    val += fillState.lu;
+
+    if (val > 255)
+        val = 255;
+    if (val < 0)
+        val = 0;
+
+    if (fillState.revert)
+        val = 255 - val;
+
+    r = g = b = val;
+}
+
+// Pixels of the proxy of 16 bits images are already transformed
+inline void pixel_proxy(const unsigned char *p, int &r, int &g, int &b, bool gray)
+{
+    b = p[0];
+    g = gray ? p[0] : p[1];
+    r = gray ? p[0] : p[2];
+
+    if (fillState.revert) {
+        r = 255 - r;
+        g = 255 - g;
+        b = 255 - b;
+    }
+}
+
 inline void pixel(int ii, int ji, int &r, int &g, int &b, Image *img)
 {
     int ji2 = ji;
 
     r = g = b = 255;
 
-    if (h360 && (ji < 0 || ji >= img->w)) {
-        while (ji2 < 0) ji2 += img->w;
-        while (ji2 >= img->w) ji2 -= img->w;
+    // ii and ji are in the reduced image
+    if (h360 && (ji < 0 || ji >= fillState.sw)) {
+        while (ji2 < 0) ji2 += fillState.sw;
+        while (ji2 >= fillState.sw) ji2 -= fillState.sw;
     }
-    if (ji2 >= 0 && ji2 < img->w && ii >= 0
-        && ii < img->h) {
-        if (gm == 1) {
+    if (ji2 >= 0 && ji2 < fillState.sw && ii >= 0
+        && ii < fillState.sh) {
+        // Move to the image as stored
+        if (img->orient != 0) {
+            int i2 = ii;
+            if (img->orient == 1) {            // 90
+                ii = ji2;
+                ji2 = fillState.sh - 1 - i2;
+            } else if (img->orient == 2) {     // 180
+                ii = fillState.sh - 1 - i2;
+                ji2 = fillState.sw - 1 - ji2;
+            } else {                           // 270
+                ii = fillState.sw - 1 - ji2;
+                ji2 = i2;
+            }
+        }
+        // Move to raster coordinates
+        ji2 -= img->bx;
+        ii -= img->by;
+        const unsigned char *p = 0;
+        bool gray = false, proxy = false;
+        if (img->tiles)
+            p = img->tiles->pixel(ii, ji2);
+        else if (ji2 >= 0 && ji2 < img->bw && ii >= 0 && ii < img->bh) {
+            size_t k = (size_t)img->bw * ii + ji2;
+            gray = img->nc == 1;
+            proxy = fillState.proxy;
+            p = proxy ? img->proxy + img->nc * k : img->buf + img->nc * img->nb * k;
+        }
+        if (p == 0) {
+            // Not decoded yet
+            r = g = b = 0;
+        } else if (proxy) {
+            pixel_proxy(p, r, g, b, gray);
+        } else if (gray && fillState.gm == 1) {
+            if (img->nb == 1)
+                pixel_gray_gm1_nb1(p, r, g, b, img);
+            else
+                pixel_gray_gm1_nb2(p, r, g, b, img);
+        } else if (gray) {
+            if (img->nb == 1)
+                pixel_gray_gm_nb1(p, r, g, b, img);
+            else
+                pixel_gray_gm_nb2(p, r, g, b, img);
+        } else if (fillState.gm == 1) {
             if (img->nb == 1)
-                pixel_gm1_nb1(ii, ji2, r, g, b, img);
+                pixel_gm1_nb1(p, r, g, b, img);
             else
-                pixel_gm1_nb2(ii, ji2, r, g, b, img);
+                pixel_gm1_nb2(p, r, g, b, img);
         } else {
             if (img->nb == 1)
-                pixel_gm_nb1(ii, ji2, r, g, b, img);
+                pixel_gm_nb1(p, r, g, b, img);
             else
-                pixel_gm_nb2(ii, ji2, r, g, b, img);
+                pixel_gm_nb2(p, r, g, b, img);
         }
     } else {
         // Outside of the image, the world is black...
@@ -586,13 +847,17 @@ inline void pixel(int ii, int ji, int &r, int &g, int &b, Image *img)
 void *async_fill_part(void *bounds)
 {
     Image *img = fillState.imgCurrent;
-    double zca = fillState.z * cos(fillState.a);
-    double zsa = fillState.z * sin(fillState.a);
+    // Work in the coordinates of the raster, which may be reduced
+    double zs = fillState.z / fillState.scale;
+    double zca = zs * cos(fillState.a);
+    double zsa = zs * sin(fillState.a);
+    double dxs = fillState.dx / fillState.scale;
+    double dys = fillState.dy / fillState.scale;
     int *p = (int *)bounds;
     for (int i = p[0]; i < p[1]; i++) {
         int idx = 4 * w * i;
-        double mix = (fillState.z * xoffset) + fillState.dx - zsa * i;
-        double miy = zca * i + fillState.dy + (fillState.z * yoffset);
+        double mix = (zs * xoffset) + dxs - zsa * i;
+        double miy = zca * i + dys + (zs * yoffset);
         double x = mix;
         double y = miy;
         for (int j = 0; j < w; j++) {
@@ -603,7 +868,7 @@ void *async_fill_part(void *bounds)
             int ii = (int)y;
 
             // If bilinear interpolation is not requested or useful
-            if (!bilin || ((z >= 1) && (fillState.a == 0))) {
+            if (!bilin || ((zs >= 1) && (fillState.a == 0))) {
                 pixel(ii, ji, r, g, b, img);
             } else    // Use bilinear interpolation
             {
@@ -646,27 +911,199 @@ void *async_fill_part(void *bounds)
     return 0;
 }
 
+// Check whether the view only shows pixels of the decoded region of a partial image
+bool view_in_raster(Image *img)
+{
+    double zca = fillState.z * cos(fillState.a);
+    double zsa = fillState.z * sin(fillState.a);
+    double x0 = fillState.z * xoffset + fillState.dx;
+    double y0 = fillState.dy + fillState.z * yoffset;
+    float xmin = 0, xmax = 0, ymin = 0, ymax = 0;
+    for (int c = 0; c < 4; c++) {
+        int i = c & 1 ? h : 0;
+        int j = c & 2 ? w : 0;
+        float x = x0 - zsa * i + zca * j;
+        float y = y0 + zca * i + zsa * j;
+        if (c == 0 || x < xmin) xmin = x;
+        if (c == 0 || x > xmax) xmax = x;
+        if (c == 0 || y < ymin) ymin = y;
+        if (c == 0 || y > ymax) ymax = y;
+    }
+    // Outside of the image there's nothing to decode
+    if (h360 && (xmin < 0 || xmax > img->w)) {
+        xmin = 0;
+        xmax = img->w;
+    }
+    xmin = max(xmin, 0.0f);
+    ymin = max(ymin, 0.0f);
+    xmax = min(xmax, (float)img->w);
+    ymax = min(ymax, (float)img->h);
+    int s = img->scale;
+    return xmin >= s * img->bx && xmax <= min(s * (img->bx + img->bw), img->w)
+        && ymin >= s * img->by && ymax <= min(s * (img->by + img->bh), img->h);
+}
+
+// Called with mutexCache locked
+Image *find_image(const char *file)
+{
+    for (Image *img = cacheFirst; img; img = img->next) {
+        if (0 == strcmp(file, img->name))
+            return img;
+    }
+    return 0;
+}
+
+// Remove img from the cache, called with mutexCache locked
+void uncache_image(Image *img)
+{
+    if (img->prev)
+        img->prev->next = img->next;
+    else
+        cacheFirst = img->next;
+    if (img->next)
+        img->next->prev = img->prev;
+    img->prev = img->next = 0;
+    img->cached = false;
+}
+
+// Make img the most recently used image, called with mutexCache locked
+void touch_image(Image *img)
+{
+    if (img->cached)
+        uncache_image(img);
+    img->next = cacheFirst;
+    if (cacheFirst)
+        cacheFirst->prev = img;
+    cacheFirst = img;
+    img->cached = true;
+}
+
+// Evict the least recently used images until the cache holds at most maxBytes bytes
+// and maxImages images. Held images, the ones being loaded among them, are kept.
+// Called with mutexCache locked.
+void trim_cache(size_t maxBytes, int maxImages)
+{
+    size_t total = 0;
+    int n = 0;
+    Image *last = 0;
+    for (Image *img = cacheFirst; img; img = img->next) {
+        total += img->bytes;
+        n++;
+        last = img;
+    }
+    for (Image *img = last; img && (total > maxBytes || n > maxImages);) {
+        Image *prev = img->prev;
+        if (img->refs == 0) {
+            if (verbose)
+                fprintf(stderr, "Evict %s from the cache\n", img->name);
+            total -= img->bytes;
+            n--;
+            uncache_image(img);
+            delete img;
+        }
+        img = prev;
+    }
+}
+
+// Keep img from being freed while it's used, returns img.
+// Every hold_image() and every image returned by load_image() is released by release_image().
+Image *hold_image(Image *img)
+{
+    if (img) {
+        MutexProtect mp(&mutexCache);
+        img->refs++;
+    }
+    return img;
+}
+
+// Snapshot of the view with its image held, see read_view().
+// The previous current image is only released after the new one is published.
+void hold_view(view_state &v)
+{
+    MutexProtect mp(&mutexCache);
+    read_view(v);
+    if (v.img)
+        v.img->refs++;
+}
+
+// Release img, it's freed if it was evicted from the cache while it was held,
+// or if the cache went over its budget meanwhile
+void release_image(Image *img)
+{
+    if (img == 0)
+        return;
+    MutexProtect mp(&mutexCache);
+    if (--img->refs > 0)
+        return;
+    if (!img->cached)
+        delete img;
+    else
+        trim_cache(cacheBytes, CACHE_NBIMAGES);
+}
+
+// Bytes of the raster of img
+size_t raster_bytes(Image *img)
+{
+    return (size_t)img->bw * img->bh * img->nc * img->nb;
+}
+
+// Memory of the decoded image counted in the cache budget.
+// Mapped rasters are in the page cache, which the kernel reclaims by itself, and tiles
+// have their own budget (see Tiles::budget) but their overview is counted.
+size_t image_bytes(Image *img)
+{
+    size_t n = img->packedLen;
+    if (img->buf && img->map == 0)
+        n += raster_bytes(img);
+    if (img->proxy)
+        n += (size_t)img->bw * img->bh * img->nc;
+    if (img->tiles)
+        n += (size_t)img->tiles->ow * img->tiles->oh * 3 * img->tiles->nb;
+    return n;
+}
+
 // Fill data with image according to zoom, angle and translation
 void fill()
 {
-    bool do_fill = true;
-    pthread_mutex_lock(&mutexData);
-    if (imgCurrent != 0) {
-        // Pack position into buffer
-        fillState.imgCurrent = imgCurrent;
-        fillState.dx = dx;
-        fillState.dy = dy;
-        fillState.z = z;
-        fillState.a = a;
-    } else do_fill = false;
-    pthread_mutex_unlock(&mutexData);
-    if (!do_fill)
+    // Pack position into buffer, the image is held until the frame is drawn
+    view_state v;
+    hold_view(v);
+    Image *img = v.img;
+    if (img == 0)
         return;
+    fillState.imgCurrent = img;
+    fillState.dx = v.dx;
+    fillState.dy = v.dy;
+    fillState.z = v.z;
+    fillState.a = v.a;
+    fillState.lu = v.lu;
+    fillState.cr = v.cr;
+    fillState.gm = v.gm;
+    fillState.revert = v.revert;
+    fillState.proxy = img->proxy && v.lu == 0 && v.cr == 255 && v.gm == 1;
+    fillState.scale = img->scale;
+    fillState.sw = (img->w + img->scale - 1) / img->scale;
+    fillState.sh = (img->h + img->scale - 1) / img->scale;
+
+    // The view left the decoded region, ask for the whole image.
+    // Turned images are always decoded whole.
+    if (img->upgrade == UPGRADE_NONE && img->orient == 0
+        && (img->bw < fillState.sw || img->bh < fillState.sh)
+        && !view_in_raster(img)) {
+        if (verbose)
+            fprintf(stderr, "View left decoded region of %s\n", img->name);
+        MutexProtect mp(&mutexCache);
+        img->upgrade = UPGRADE_WANTED;
+        pthread_cond_signal(&condUpgrade);
+    }
+    // Install tiles decoded since the last frame
+    if (img->tiles)
+        img->tiles->frame(fillState.z);
 
-    if (gm != powe) {
-        powe = gm;
+    if (fillState.gm != powe) {
+        powe = fillState.gm;
         for (int i = 0; i < 256; i++)
-            powv[i] = (int)(255 * powf((float)i / (float)255, gm));
+            powv[i] = (int)(255 * powf((float)i / (float)255, fillState.gm));
     }
 
 
@@ -677,8 +1114,8 @@ void fill()
         fillBounds[ncores] = h;
 
         for (int i = 0; i < ncores; i++)
-            pthread_create(thFill + i, NULL, async_fill_part,
-                       fillBounds + i);
+            pthread_create(thFill + i, fillAttr ? fillAttr + i : NULL,
+                       async_fill_part, fillBounds + i);
 
         void *r;
         for (int i = 0; i < ncores; i++)
@@ -690,6 +1127,17 @@ void fill()
         bounds[1] = h;
         async_fill_part(bounds);
     }
+    release_image(img);
+}
+
+// Whether tiles of the current image were decoded since the last frame.
+// The image of the view can't be freed while mutexCache is held, see hold_view().
+bool tiles_ready()
+{
+    MutexProtect mp(&mutexCache);
+    view_state v;
+    read_view(v);
+    return v.img && v.img->tiles && v.img->tiles->ready;
 }
 
 // Asynchronous image filling
@@ -708,6 +1156,9 @@ void *async_fill(void *)
     int delay = 20000;
     bool posChanged = false;
 
+    if (ncores <= 1)
+        set_thread_cpus(&fillCpus);
+
     #ifdef WATCHDOG
     if (pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &watchdog_counter)) {
         perror("ERROR setting cancellation type for async_fill thread");
@@ -722,23 +1173,23 @@ void *async_fill(void *)
                 watchdog_counter = 1;
         #endif
         // If something changed we need to redraw
-        pthread_mutex_lock(&mutexData);
-        if (za != z || dx != dxa || dy != dya || aa != a) {
+        view_state v;
+        read_view(v);
+        if (za != v.z || v.dx != dxa || v.dy != dya || aa != v.a) {
             posChanged = true;
-            za = z; dxa = dx; dya = dy; aa = a;
+            za = v.z; dxa = v.dx; dya = v.dy; aa = v.a;
         } else { posChanged = false; }
-        pthread_mutex_unlock(&mutexData);
         if (posChanged ||
-            la != lu || ca != cr || ra != revert || gma != gm
+            la != v.lu || ca != v.cr || ra != v.revert || gma != v.gm
             || bilina != bilin || zx1a != zx1 || zx2a != zx2
-            || zy1a != zy1 || zy2a != zy2 || refresh) {
+            || zy1a != zy1 || zy2a != zy2 || refresh || tiles_ready()) {
             delay = 5000;
             refresh = false;
-            la = lu;
-            ca = cr;
+            la = v.lu;
+            ca = v.cr;
             bilina = bilin;
-            gma = gm;
-            ra = revert;
+            gma = v.gm;
+            ra = v.revert;
             zx1a = zx1;
             zx2a = zx2;
             zy1a = zy1;
@@ -806,97 +1257,509 @@ void full_extend()
         fprintf(stderr, "Full extend %f %f %f\n", z, dx, dy);
 }
 
+void translate(float stepX, float stepY)
+{
+    float xp = dx - (-z * cos(a) * stepX - z * sin(a) * stepY);
+    float yp = dy - (-z * sin(a) * stepX + z * cos(a) * stepY);
+
+    // Constrain dy so that no black bars show up above or below the image
+    if (imgCurrent) {
+        if (yp < 0) yp = 0;
+        else if (yp > imgCurrent->h - h * z) yp = imgCurrent->h - h*z;
+
+        if (h360) {
+            // Wrap-around
+            if (xp > imgCurrent->w)
+                xp -= imgCurrent->w;
+            else if (xp < -imgCurrent->w)
+                xp += imgCurrent->w;
+        } else {
+            if (xp > imgCurrent->w - 10)
+                xp = imgCurrent->w - 10;
+            if (xp / z < -w + 10)
+                xp = (10 -w) * z;
+        }
+    }
+    dx = xp;
+    dy = yp;
+}
+
+void zoom(float zf)
+{
+    float xp = z * cos(a) * w / 2 - z * sin(a) * h / 2 + dx;
+    float yp = z * sin(a) * h / 2 + z * cos(a) * h / 2 + dy;
+
+    // Constrain zoom amount
+    if (zf < minz) zf = minz;
+    if (zf > maxz) zf = maxz;
+
+    xp = xp - (zf * cos(a) * w / 2 - zf * sin(a) * h / 2);
+    yp = yp - (zf * sin(a) * w / 2 + zf * cos(a) * h / 2);
+
+    // Constrain dy so that no black bars show up above or below the image
+    if (imgCurrent) {
+        if (yp < 0) yp = 0;
+        else if (yp > imgCurrent->h - h * zf) yp = imgCurrent->h - h*zf;
+    
+        if (h360) {
+            // Wrap-around
+            if (xp > imgCurrent->w)
+                xp -= imgCurrent->w;
+            else if (xp < -imgCurrent->w)
+                xp += imgCurrent->w;
+        } else {
+            if (xp > imgCurrent->w - 10)
+                xp = imgCurrent->w - 10;
+            if (xp / z < -w + 10)
+                xp = (10 -w) * z;
+        }
+    }
+    z = zf;
+    dx = xp;
+    dy = yp;
+}
+
+// Move the view as told by a z, c or m fifo command. Called with mutexData locked.
+void fifo_move(const char *msg)
+{
+    if (strstr(msg, "z") == msg) {
+        float zc = atof(msg + 2);
+        if (zc <= 0) {
+            full_extend();
+        } else {
+            zoom(zc);
+        }
+    } else if (strstr(msg, "c") == msg) {
+        int xp, yp;
+        sscanf(msg, "c %d %d\n", &xp, &yp);
+        dx = xp - (z * cos(a) * (w / 2) -
+               z * sin(a) * (h / 2));
+        dy = yp - (z * sin(a) * (w / 2) +
+               z * cos(a) * (h / 2));
+    } else if (strstr(msg, "m") == msg) {
+        int dxp, dyp;
+        sscanf(msg, "m %d %d\n", &dxp, &dyp);
+        translate(dxp, dyp);
+    }
+}
+
+// Drop the positions kept for loadingFile. Called with mutexData locked.
+void drop_moves()
+{
+    posPending = false;
+    for (int i = 0; i < movesLen; i++)
+        free(movesPending[i]);
+    movesLen = 0;
+}
+
 Image *get_image_from_cache(const char *file)
 {
     MutexProtect mp(&mutexCache);
-    for (int i = 0; i < CACHE_NBIMAGES; i++) {
-        if (imgCache[i] && 0 == strcmp(file, imgCache[i]->name)) {
-            return imgCache[i];
+    return find_image(file);
+}
+
+// Whether loading file is still useful: it is the image to display or it's in the prefetch window.
+// Called with mutexCache locked.
+bool load_wanted(const char *file)
+{
+    if (wantedFile == 0 || 0 == strcmp(file, wantedFile))
+        return true;
+    for (int k = 0; k < prefetchLen; k++) {
+        if (0 == strcmp(file, files[prefetchWindow[k]]))
+            return true;
+    }
+    return false;
+}
+
+// Compute the prefetch window around idxfile. The browse direction is the one of the shortest
+// way from the previous image, so that steps of several images and wrapping around count.
+// At the same distance the image ahead comes before the one behind.
+// Called with mutexCache locked.
+void update_window()
+{
+    if (prefetchWindow == 0) {
+        prefetchWindow = (int *)malloc((1 + prefetchAhead + prefetchBehind) * sizeof(int));
+        if (prefetchWindow == NULL) {
+            fprintf(stderr, "Not enough memory\n");
+            exit(1);
         }
     }
-    return 0;
+    prefetchLen = 0;
+    if (nbfiles == 0 || idxfile < 0 || idxfile >= nbfiles)
+        return;
+    if (windowIdx >= 0 && windowIdx < nbfiles && idxfile != windowIdx)
+        browseDir = (idxfile - windowIdx + nbfiles) % nbfiles <= nbfiles / 2 ? 1 : -1;
+    windowIdx = idxfile;
+    int ahead = min(prefetchAhead, nbfiles - 1);
+    int behind = min(prefetchBehind, nbfiles - 1 - ahead);
+    prefetchWindow[prefetchLen++] = idxfile;
+    for (int d = 1; d <= ahead || d <= behind; d++) {
+        if (d <= ahead)
+            prefetchWindow[prefetchLen++] = ((idxfile + browseDir * d) % nbfiles + nbfiles) % nbfiles;
+        if (d <= behind)
+            prefetchWindow[prefetchLen++] = ((idxfile - browseDir * d) % nbfiles + nbfiles) % nbfiles;
+    }
+    pthread_cond_broadcast(&condPrefetch);
 }
 
-// Load an image, tries to open as ppm, then jpeg, then tiff and if fails, use imagemagick to convert to ppm
-Image *load_image(const char *file)
+// Make file the image to display and cancel the loads of the images which won't be shown,
+// so that quickly skipping through images only decodes the last one.
+void want_image(const char *file)
 {
-    Image *img = get_image_from_cache(file);
-    if (img) {
-        // We are already loading the file from another thread
-        // Wait for loading is done
-        while (img && img->state == IN_PROGRESS) {
-            usleep(50000);
-            img = get_image_from_cache(file);
+    MutexProtect mp(&mutexCache);
+    free(wantedFile);
+    wantedFile = strdup(file);
+    update_window();
+    for (Image *img = cacheFirst; img; img = img->next) {
+        if (img->state == IN_PROGRESS && !img->cancel && !load_wanted(img->name)) {
+            if (verbose)
+                fprintf(stderr, "Cancel loading %s\n", img->name);
+            img->cancel = true;
         }
-        if (img->state == READY)
-            return img;
-        if (img)    // Error occured
-            return 0;
-        // Image was removed from cache, reload it
     }
+}
+
+// Whether file is still the image to display
+bool is_wanted(const char *file)
+{
+    MutexProtect mp(&mutexCache);
+    return wantedFile == 0 || 0 == strcmp(file, wantedFile);
+}
+
+// Region of an iW x iH image this window shows when the image fits the window height,
+// which is the largest extent (see full_extend()), or when zooming in around the center.
+// It is what a slave with -xoffset/-yoffset needs of a panorama.
+void view_footprint(int iW, int iH, int &x, int &y, int &rw, int &rh)
+{
+    float zf = (float)iH / (float)h;
+    float x0 = iW / 2 + zf * min(0.0f, xoffset - w / 2.0f);
+    float x1 = iW / 2 + zf * max(0.0f, xoffset + w / 2.0f);
+    float y0 = iH / 2 + zf * min(0.0f, yoffset - h / 2.0f);
+    float y1 = iH / 2 + zf * max(0.0f, yoffset + h / 2.0f);
+    x = (int)floor(x0);
+    y = (int)floor(y0);
+    rw = (int)ceil(x1) - x;
+    rh = (int)ceil(y1) - y;
+}
+
+// Reduction of the first quick decode of a big image, 1 if it's not worth it.
+// The reduced image keeps at least a quarter of the window height.
+int preview_scale(int iW, int iH)
+{
+    if ((float)iW * iH < 16.0f * w * h)
+        return 1;
+    for (int s = 8; s > 1; s /= 2) {
+        if (iH / s >= h / 4)
+            return s;
+    }
+    return 1;
+}
+
+// Largest reduction, up to 8, at which the window still gets a pixel of the image per pixel
+// of the screen at the maximum zoom: the image fits the window height when shown, see
+// full_extend(), and is then zoomed in at most zoom_max times.
+int need_scale(int iW, int iH)
+{
+    int s = 1;
+    while (needRes && h > 0 && s < 8 && 2 * s * zoom_max * h <= iH)
+        s *= 2;
+    return s;
+}
 
-    img = new Image(0, 0, 0, 0, 0, file, 0);
+// Reduction for a JPEG image which can't be read by tiles to fit in virtualMin bytes,
+// images are never decoded finer than need_scale()
+int fit_scale(int iW, int iH)
+{
+    int s = need_scale(iW, iH);
+    while (s < 8 && (size_t)((iW + s - 1) / s) * ((iH + s - 1) / s) * 3 > virtualMin)
+        s *= 2;
+    return s;
+}
 
-    // Add image to cache
-    if (img) {
-        MutexProtect mp(&mutexCache);
-        if (imgCache[idxCache]) {
-            delete imgCache[idxCache];
+// Reduction of the first decode of a JPEG image shown right away
+int first_scale(int iW, int iH)
+{
+    return max(preview_scale(iW, iH), fit_scale(iW, iH));
+}
+
+// After the window grew, drop the images decoded coarser than it now needs (see need_scale())
+// so that they are loaded again. Returns whether the image to display was dropped.
+bool rescale_cache()
+{
+    bool wanted = false;
+    MutexProtect mp(&mutexCache);
+    for (Image *img = cacheFirst; img;) {
+        Image *next = img->next;
+        int iW = img->orient & 1 ? img->h : img->w;
+        int iH = img->orient & 1 ? img->w : img->h;
+        if (img->state == READY && img->tiles == 0 && img->scale > fit_scale(iW, iH)) {
+            if (verbose)
+                fprintf(stderr, "Drop %s reduced by %d\n", img->name, img->scale);
+            wanted = wanted || wantedFile == 0 || 0 == strcmp(img->name, wantedFile);
+            uncache_image(img);
+            if (img->refs == 0)
+                delete img;
         }
-        imgCache[idxCache] = img;
-        idxCache++;
-        idxCache %= CACHE_NBIMAGES;
-    } else
+        img = next;
+    }
+    return wanted;
+}
+
+// Whether r is the whole image at the resolution this process wants
+bool full_raster(const struct shared_raster &r)
+{
+    return r.bx == 0 && r.by == 0 && r.bw == (r.w + r.scale - 1) / r.scale
+        && r.bh == (r.h + r.scale - 1) / r.scale && r.scale <= fit_scale(r.w, r.h);
+}
+
+// Raster of img as stored, before it's turned
+void image_raster(Image *img, struct shared_raster &r)
+{
+    r.w = img->orient & 1 ? img->h : img->w;
+    r.h = img->orient & 1 ? img->w : img->h;
+    r.nb = img->nb;
+    r.nc = img->nc;
+    r.max = img->max;
+    r.orient = img->orient;
+    r.scale = img->scale;
+    r.bx = img->bx;
+    r.by = img->by;
+    r.bw = img->bw;
+    r.bh = img->bh;
+}
+
+// Queue img, whose full raster was decoded by this process, to be stored in diskCache.
+// Called with mutexCache locked.
+void store_image(Image *img)
+{
+    struct shared_raster r;
+    image_raster(img, r);
+    if (diskCache == 0 || storeLen == STORE_QUEUE || !full_raster(r))
+        return;
+    img->refs++;
+    storeQueue[storeLen++] = img;
+    pthread_cond_signal(&condStore);
+}
+
+// Move buf, the raster of file decoded by this process, to the shared cache if it's a full raster
+// so that the other xiv of the node map it instead of decoding it. Returns the raster to use.
+unsigned char *share_raster(const char *file, const struct shared_raster &r, unsigned char *buf,
+                            void *&map, size_t &mapLen)
+{
+    unsigned char *shared = full_raster(r) ? shared_publish(file, r, buf, map, mapLen) : 0;
+    if (shared == 0) {
+        shared_drop(file);
+        return buf;
+    }
+    free(buf);
+    return shared;
+}
+
+// Build the 8 bits proxy of the raster of a 16 bits image, drawn instead of it with the
+// default radiometry so that 16 bits images are drawn as fast as 8 bits ones
+void build_proxy(Image *img)
+{
+    if (img->buf && img->nb == 2 && img->proxy == 0)
+        img->proxy = make_proxy((const unsigned short *)img->buf,
+                                (size_t)img->bw * img->bh * img->nc, img->nbits);
+}
+
+// Uncompress the raster of img, packed by async_pack(), and return img.
+// img is held and IN_PROGRESS, it's released and 0 is returned if there isn't enough memory.
+Image *unpack_image(Image *img)
+{
+    unsigned char *buf = unpack_raster(img->packed, raster_bytes(img));
+    if (buf) {
+        img->buf = buf;
+        build_proxy(img);
+    }
+    MutexProtect mp(&mutexCache);
+    img->cancel = false;
+    pthread_cond_broadcast(&condCache);
+    if (buf == 0) {
+        fprintf(stderr, "Unable to uncompress %s\n", img->name);
+        // It will be decoded again
+        uncache_image(img);
+        img->state = ERROR;
+        if (--img->refs == 0)
+            delete img;
         return 0;
+    }
+    if (verbose)
+        fprintf(stderr, "Uncompressed %s\n", img->name);
+    free(img->packed);
+    img->packed = 0;
+    img->packedLen = 0;
+    img->state = READY;
+    img->bytes = image_bytes(img);
+    trim_cache(cacheBytes, CACHE_NBIMAGES);
+    return img;
+}
+
+// Load an image with the reader of its format, ImageMagick converts the formats which have none
+// If fast is set, big JPEG images are first loaded reduced and upgraded later (see upgrade_image()).
+// The image is held, see hold_image().
+Image *load_image(const char *file, bool fast = false)
+{
+    Image *img;
+    {
+        MutexProtect mp(&mutexCache);
+        img = find_image(file);
+        // We are already loading the file from another thread
+        // Wait for loading is done
+        while (img && img->state == IN_PROGRESS) {
+            pthread_cond_wait(&condCache, &mutexCache);
+            img = find_image(file);
+        }
+        if (img) {    // Loaded or error occured
+            if (img->state != READY)
+                return 0;
+            img->refs++;
+            touch_image(img);
+            if (img->packed == 0)
+                return img;
+            // Other loaders wait for it to be uncompressed
+            img->state = IN_PROGRESS;
+        } else {
+            // Image was never loaded, evicted or cancelled, load it.
+            // It's held by the loader, then by the caller.
+            img = new Image(0, 0, 0, 0, 0, file, 0);
+            img->refs = 1;
+            touch_image(img);
+        }
+    }
+    if (img->packed)
+        return unpack_image(img);
 
     int wi, hi, nbBytes, valMax;
-    // Try PPM -> JPEG -> TIFF -> convert
-    struct stat statBuf;
+    // Gray images are kept with a single sample per pixel
+    int nc = 3;
+    // The file is opened once and read by the reader of the format told by its first bytes,
+    // ImageMagick converts the other formats and the files which the reader rejects.
+    struct image_file f;
     unsigned char *buf = 0;
-    if (0 == stat(file, &statBuf))    // File exist
+    Tiles *tiles = 0;
+    void *map = 0;
+    size_t mapLen = 0;
+    int bx = 0, by = 0, bw = 0, bh = 0, scale = 1;
+    // Perform autorotate if requested
+    int ai = 0;
+    // A previous xiv may have stored it, another xiv of the node may have decoded it
+    // or be decoding it
+    struct shared_raster sr;
+    if (diskCache)
+        buf = disk_find(file, sr, map, mapLen);
+    if (buf && !full_raster(sr)) {
+        // Stored at a lower resolution than this process wants
+        munmap(map, mapLen);
+        map = 0;
+        buf = 0;
+    }
+    if (verbose && buf)
+        fprintf(stderr, "Mapped stored raster of %s\n", file);
+    if (buf == 0 && sharedCache) {
+        buf = shared_find(file, true, sr, map, mapLen, &img->cancel);
+        if (buf && !full_raster(sr)) {
+            // Decoded for a smaller window, see need_scale()
+            munmap(map, mapLen);
+            map = 0;
+            buf = 0;
+        }
+        if (verbose && buf)
+            fprintf(stderr, "Mapped shared raster of %s\n", file);
+    }
+    if (buf) {
+        wi = sr.w;
+        hi = sr.h;
+        nbBytes = sr.nb;
+        nc = sr.nc;
+        valMax = sr.max;
+        ai = sr.orient;
+        scale = sr.scale;
+        bx = sr.bx;
+        by = sr.by;
+        bw = sr.bw;
+        bh = sr.bh;
+    } else if (open_image_file(file, f))    // File exist
     {
-        // Try ppm
-        buf = read_ppm(file, wi, hi, nbBytes, valMax);
-        if (buf == 0)    // No success, try jpeg
-        {
-            buf = read_jpeg(file, wi, hi);
-            if (verbose && buf)
-                fprintf(stderr,
-                    "Success reading jpeg file %s\n", file);
+        f.cancel = &img->cancel;
+        ai = autorot ? read_orientation(f) : 0;
+        switch (f.format) {
+        case IMAGE_PYRAMID:
+            // Pyramids made by xiv-prep are mapped and drawn by tiles
+            tiles = open_pyramid_tiles(f, wi, hi, nbBytes, valMax);
+            break;
+        case IMAGE_PPM:
+            // 8 bits ppm are used in place
+            buf = map_ppm(f, wi, hi, map, mapLen, &nc);
+            if (buf) {
+                nbBytes = 1;
+                valMax = 255;
+                if (verbose)
+                    fprintf(stderr, "Mapped raster of %s\n", file);
+            }
+            // Big 16 bits ppm are read by tiles
+            if (buf == 0) {
+                tiles = open_ppm_tiles(f, wi, hi, valMax, virtualMin);
+                nbBytes = 2;
+            }
+            if (buf == 0 && tiles == 0)
+                buf = read_ppm(f, wi, hi, nbBytes, valMax, &nc);
+            break;
+        case IMAGE_JPEG:
+            // Big jpeg with restart markers are decoded by tiles
+            tiles = open_jpeg_tiles(f, wi, hi, virtualMin);
+            nbBytes = 1;
+            valMax = 255;
+            if (tiles == 0)
+            {
+                // Partial and reduced decoding is only done for images which are not rotated
+                buf = read_jpeg_roi(f, wi, hi,
+                            ai != 0 ? 0 : fast && preview ? first_scale : fit_scale, scale,
+                            roi && ai == 0 ? view_footprint : 0,
+                            bx, by, bw, bh);
+                if (verbose && buf && scale > 1)
+                    fprintf(stderr, "Decoded reduced by %d\n", scale);
+                if (verbose && buf && (bw < (wi + scale - 1) / scale || bh < (hi + scale - 1) / scale))
+                    fprintf(stderr, "Decoded region %d %d %d %d of %d x %d\n",
+                        bx, by, bw, bh, wi, hi);
+                if (verbose && buf)
+                    fprintf(stderr,
+                        "Success reading jpeg file %s\n", file);
+            }
+            break;
+        case IMAGE_TIFF:
+            // Uncompressed 8 bits tiff are used in place
+            buf = map_tiff(f, wi, hi, map, mapLen, &nc);
             nbBytes = 1;
             valMax = 255;
-        }
-        if (buf == 0)    // No success, try tiff
-        {
-            buf = read_tiff(file, wi, hi, nbBytes, valMax);
+            if (verbose && buf)
+                fprintf(stderr, "Mapped raster of %s\n", file);
+            // Tiled or big tiff are decoded when drawn
+            if (buf == 0)
+                tiles = open_tiff_tiles(f, wi, hi, nbBytes, valMax, virtualMin);
+            if (buf == 0 && tiles == 0)
+            {
+                buf = read_tiff(f, wi, hi, nbBytes, valMax, &nc);
+                if (verbose && buf)
+                    fprintf(stderr,
+                        "Success reading tiff file %s\n", file);
+            }
+            break;
+        case IMAGE_PNG:
+            buf = read_png(f, wi, hi, nbBytes, valMax, &nc);
             if (verbose && buf)
                 fprintf(stderr,
-                    "Success reading tiff file %s\n", file);
+                    "Success reading png file %s\n", file);
+            break;
         }
-        if (buf == 0)    // No success, convert with ImageMagick
+        close_image_file(f);
+        if (buf == 0 && tiles == 0 && !img->cancel)    // No success, convert with ImageMagick
         {
             if (verbose)
                 fprintf(stderr,
                     "Converting image with ImageMagick\n");
-            char cmd[2048];
-            char tmp[32];
-            char *tmpdir = getenv("TMP");
-            sprintf(tmp, "%s/xiv_XXXXXX",
-                tmpdir == NULL ? "/tmp" : tmpdir);
-            int ret = mkstemp(tmp);
-            if (ret == -1) {
-                fprintf(stderr, "Error creating tmp file %s\n",
-                    tmpdir == NULL ? "/tmp" : tmpdir);
-            }
-            close(ret);
-            unlink(tmp);
-            strcat(tmp, ".ppm");
-            sprintf(cmd, "convert \"%s\" -quiet %s", file, tmp);
-            if (system(cmd) == -1) {
-                fprintf(stderr,
-                    "Error calling ImageMagick convert\n");
-            }
-            buf = read_ppm(tmp, wi, hi, nbBytes, valMax);
+            buf = read_converted(file, wi, hi, nbBytes, valMax, &nc);
             if (!buf) {
                 fprintf(stderr,
                     "Unable to read converted image\n");
@@ -904,111 +1767,172 @@ Image *load_image(const char *file)
                 fprintf(stderr,
                     "Success reading converted file %s\n",
                     file);
-            unlink(tmp);
         }
     }
 
-    if (buf) {
+    if (buf || tiles) {
         int nbits = (int)round(log(valMax) / log(2));
         img->nb = nbBytes;
+        img->nc = nc;
         img->max = valMax;
         img->nbits = nbits;
-        // Perform autorotate if requested
-        int ai = autorot ? orientation(file) : 0;
-        if (verbose)
-            fprintf(stderr, "Orientation %d\n", ai);
-        if (ai == 0) {
-            img->w = wi;
-            img->h = hi;
-            img->buf = buf;
-            img->state = READY;
-        } else if (ai == 1)    // 90
-        {
-            unsigned char *buf2 =
-                (unsigned char *)malloc(wi * hi * 3);
-            if (!buf2) {
-                free(buf);
-                return 0;
-            }
-            for (int i = 0; i < hi; i++) {
-                int jn = i;
-                for (int j = 0; j < wi; j++) {
-                    int in = wi - j - 1;
-                    buf2[3 * (in * hi + jn) + 0] =
-                        buf[3 * (i * wi + j) + 0];
-                    buf2[3 * (in * hi + jn) + 1] =
-                        buf[3 * (i * wi + j) + 1];
-                    buf2[3 * (in * hi + jn) + 2] =
-                        buf[3 * (i * wi + j) + 2];
-                }
-            }
-            ai = 0;
-            img->w = hi;
-            img->h = wi;
-            img->buf = buf2;
-            img->state = READY;
-            free(buf);
-        } else if (ai == 2)    //180
-        {
-            unsigned char *buf2 =
-                (unsigned char *)malloc(wi * hi * 3);
-            if (!buf2) {
-                free(buf);
-                return 0;
-            }
-            for (int i = 0; i < hi; i++) {
-                int in = hi - i - 1;
-                for (int j = 0; j < wi; j++) {
-                    int jn = wi - j - 1;
-                    buf2[3 * (in * hi + jn) + 0] =
-                        buf[3 * (i * wi + j) + 0];
-                    buf2[3 * (in * hi + jn) + 1] =
-                        buf[3 * (i * wi + j) + 1];
-                    buf2[3 * (in * hi + jn) + 2] =
-                        buf[3 * (i * wi + j) + 2];
-                }
-            }
-            ai = 0;
-            img->w = wi;
-            img->h = hi;
-            img->buf = buf2;
-            img->state = READY;
-            free(buf);
-        } else if (ai == 3)    //270
-        {
-            unsigned char *buf2 =
-                (unsigned char *)malloc(wi * hi * 3);
-            if (!buf2) {
-                free(buf);
-                return 0;
-            }
-            for (int i = 0; i < hi; i++) {
-                int jn = i;
-                for (int j = 0; j < wi; j++) {
-                    int in = j;
-                    buf2[3 * (in * hi + jn) + 0] =
-                        buf[3 * (i * wi + j) + 0];
-                    buf2[3 * (in * hi + jn) + 1] =
-                        buf[3 * (i * wi + j) + 1];
-                    buf2[3 * (in * hi + jn) + 2] =
-                        buf[3 * (i * wi + j) + 2];
-                }
-            }
-            ai = 0;
-            img->w = hi;
-            img->h = wi;
-            img->buf = buf2;
-            img->state = READY;
+        if (bw == 0) {
+            bw = wi;
+            bh = hi;
+        }
+        bool decoded = buf && map == 0;
+        // JPEG images are decoded reduced, the pixels of the other ones are averaged
+        int s = decoded && ai == 0 && scale == 1 && bw == wi && bh == hi ? need_scale(wi, hi) : 1;
+        unsigned char *reduced = s > 1 ? reduce_raster(buf, wi, hi, nc, nbBytes, s) : 0;
+        if (reduced) {
+            if (verbose)
+                fprintf(stderr, "Reduced by %d\n", s);
             free(buf);
+            buf = reduced;
+            scale = s;
+            bw = (wi + s - 1) / s;
+            bh = (hi + s - 1) / s;
         }
+        if (sharedCache && decoded) {
+            struct shared_raster r = { wi, hi, nbBytes, nc, valMax, ai, scale, bx, by, bw, bh };
+            buf = share_raster(file, r, buf, map, mapLen);
+        } else if (sharedCache)
+            // Mapped in place or read by tiles, other xiv map or read the file as well
+            shared_drop(file);
+        if (verbose)
+            fprintf(stderr, "Orientation %d\n", ai);
+        // Turned images keep their raster as stored, it is turned when drawn
+        img->orient = ai;
+        img->w = ai & 1 ? hi : wi;
+        img->h = ai & 1 ? wi : hi;
+        img->scale = scale;
+        img->bx = bx;
+        img->by = by;
+        img->bw = bw;
+        img->bh = bh;
+        // Full resolution is wanted as soon as possible
+        if (scale > fit_scale(wi, hi))
+            img->upgrade = UPGRADE_WANTED;
+        img->buf = buf;
+        img->tiles = tiles;
+        img->map = map;
+        img->mapLen = mapLen;
+        build_proxy(img);
+        MutexProtect mp(&mutexCache);
+        img->state = READY;
+        img->bytes = image_bytes(img);
+        if (decoded)
+            store_image(img);
+        trim_cache(cacheBytes, CACHE_NBIMAGES);
+        pthread_cond_broadcast(&condCache);
     } else {
-        img->state = ERROR;
+        if (sharedCache)
+            shared_drop(file);
+        MutexProtect mp(&mutexCache);
+        if (img->cancel) {
+            // Not an error, it may be loaded again
+            if (verbose)
+                fprintf(stderr, "Loading %s cancelled\n", file);
+            uncache_image(img);
+        } else
+            img->state = ERROR;
+        // Failed images stay cached so that they aren't read again
+        if (--img->refs == 0 && !img->cached)
+            delete img;
+        pthread_cond_broadcast(&condCache);
         return 0;
     }
 
     return img;
 }
 
+// Replace the reduced or partial raster of img by the full resolution one.
+// A reduced raster is replaced by the same region at full resolution, a partial one by the whole image.
+// Full resolution of images too big for memory is the one given by fit_scale().
+void upgrade_image(Image *img)
+{
+    int wi, hi, bx, by, bw, bh, scale;
+    bool region = roi && img->scale > fit_scale(img->w, img->h);
+    if (verbose)
+        fprintf(stderr, "Decoding %s of %s\n", region ? "region" : "the whole image", img->name);
+    struct image_file f;
+    unsigned char *buf = 0;
+    void *map = 0;
+    size_t mapLen = 0;
+    // A previous xiv may have stored the whole image, another xiv of the node may have decoded it
+    struct shared_raster sr;
+    if (diskCache && !region)
+        buf = disk_find(img->name, sr, map, mapLen);
+    if (buf == 0 && sharedCache && !region)
+        buf = shared_find(img->name, true, sr, map, mapLen, 0);
+    bool decoded = false;
+    if (buf) {
+        if (full_raster(sr) && sr.orient == 0 && sr.nb == 1 && sr.nc == 3) {
+            wi = sr.w;
+            hi = sr.h;
+            scale = sr.scale;
+            bx = by = 0;
+            bw = sr.bw;
+            bh = sr.bh;
+            if (verbose)
+                fprintf(stderr, "Mapped the raster of %s\n", img->name);
+        } else {
+            munmap(map, mapLen);
+            map = 0;
+            buf = 0;
+        }
+    }
+    if (buf == 0 && open_image_file(img->name, f)) {
+        buf = read_jpeg_roi(f, wi, hi, fit_scale, scale,
+                            region ? view_footprint : 0, bx, by, bw, bh);
+        close_image_file(f);
+        decoded = true;
+        if (sharedCache && !region && buf) {
+            struct shared_raster r = { wi, hi, 1, 3, 255, 0, scale, bx, by, bw, bh };
+            buf = share_raster(img->name, r, buf, map, mapLen);
+        }
+    }
+    if (buf == 0 || wi != img->w || hi != img->h) {
+        fprintf(stderr, "Unable to decode the whole image %s\n", img->name);
+        if (map)
+            munmap(map, mapLen);
+        else
+            free(buf);
+        if (sharedCache && !region)
+            shared_drop(img->name);
+        img->upgrade = UPGRADE_DONE;
+        return;
+    }
+    // Nothing is drawn while the window is locked
+    pthread_mutex_lock(&mutexWin);
+    unsigned char *old = img->buf;
+    void *oldMap = img->map;
+    size_t oldMapLen = img->mapLen;
+    img->buf = buf;
+    img->map = map;
+    img->mapLen = mapLen;
+    img->scale = scale;
+    img->bx = bx;
+    img->by = by;
+    img->bw = bw;
+    img->bh = bh;
+    img->upgrade = bw < (wi + scale - 1) / scale || bh < (hi + scale - 1) / scale
+        ? UPGRADE_NONE : UPGRADE_DONE;
+    pthread_mutex_unlock(&mutexWin);
+    if (oldMap)
+        munmap(oldMap, oldMapLen);
+    else
+        free(old);
+    {
+        MutexProtect mp(&mutexCache);
+        img->bytes = image_bytes(img);
+        if (decoded)
+            store_image(img);
+        trim_cache(cacheBytes, CACHE_NBIMAGES);
+    }
+    refresh = true;
+}
+
 // Set WM_CLASS
 void set_class(void) {
     XClassHint *xch;
@@ -1046,13 +1970,16 @@ void set_title(const char *file)
     XStoreName(display, window, title);
 }
 
-// Display the image
+// Display the image. It's loaded by async_display() while the current image is still shown,
+// only the cursor tells it's loading. Called with mutexData locked.
 void display_image(const char *file)
 {
     if (verbose)
         fprintf(stderr, "display_image %s\n", file);
-    for (int i = 0; i < 20; i++)
-        pts[i] = -1;
+    // Positions kept for the previous image to display no longer apply
+    free(loadingFile);
+    loadingFile = strdup(file);
+    drop_moves();
     // Set the wait cursor
     if (!fakewin) {
         pthread_mutex_lock(&mutexWin);
@@ -1061,65 +1988,275 @@ void display_image(const char *file)
         XFlush(display);
     }
 
-    histMax = 0;
-    imgCurrent = load_image(file);
-    if (imgCurrent == 0)
-        imgCurrent = load_image(PREFIX "/share/xiv/xiv.ppm");
-    if (imgCurrent == 0)
-        fprintf(stderr,
-            "Can't open default file %s, there's something wrong with the installation\n",
-            PREFIX "/share/xiv/xiv.ppm");
-    // Init to image fitting in window
-    full_extend();
-
-    cr = 255;
-    refresh = true;
-    // Restore normal cursor
-    if (!fakewin) {
-        pthread_mutex_lock(&mutexWin);
-        XDefineCursor(display, window, normal);
-        set_title(file);
-        pthread_mutex_unlock(&mutexWin);
+    want_image(file);
+    MutexProtect mp(&mutexCache);
+    displayPending = true;
+    pthread_cond_signal(&condDisplay);
+}
+
+// Make img, loaded for file, the current image fitting in the window
+void show_image(Image *img, const char *file)
+{
+    pthread_mutex_lock(&mutexData);
+    for (int i = 0; i < 20; i++)
+        pts[i] = -1;
+    histMax = 0;
+    // The previous image is freed once the frame drawing it is done if it was evicted
+    Image *old = imgCurrent;
+    imgCurrent = img;
+    full_extend();
+    if (loadingFile && 0 == strcmp(file, loadingFile)) {
+        if (posPending) {
+            dx = posDx;
+            dy = posDy;
+            z = posZ;
+        }
+        for (int i = 0; i < movesLen; i++)
+            fifo_move(movesPending[i]);
+        drop_moves();
+        free(loadingFile);
+        loadingFile = 0;
+    }
+    cr = 255;
+    refresh = true;
+    unlock_view();
+    release_image(old);
+    {
+        // A preview is completed right away
+        MutexProtect mp(&mutexCache);
+        pthread_cond_signal(&condUpgrade);
+    }
+    // Restore normal cursor
+    if (!fakewin) {
+        pthread_mutex_lock(&mutexWin);
+        XDefineCursor(display, window, normal);
+        set_title(file);
+        pthread_mutex_unlock(&mutexWin);
+    }
+}
+
+// Switching thread, loads the image asked for by display_image() without locking mutexData
+// and shows it if it's still the one to display
+void *async_display(void *)
+{
+    pthread_mutex_lock(&mutexCache);
+    while (nbfiles > 0 && !displayStopped) {
+        if (!displayPending) {
+            pthread_cond_wait(&condDisplay, &mutexCache);
+            continue;
+        }
+        displayPending = false;
+        char *file = strdup(wantedFile);
+        pthread_mutex_unlock(&mutexCache);
+
+        Image *img = load_image(file, true);
+        // Another image was asked for while this one was loading, it is the one to show.
+        // The window is going away once the thread is stopped.
+        if (!is_wanted(file) || displayStopped)
+            release_image(img);
+        else {
+            if (img == 0)
+                img = load_image(PREFIX "/share/xiv/xiv.ppm");
+            if (img == 0)
+                fprintf(stderr,
+                    "Can't open default file %s, there's something wrong with the installation\n",
+                    PREFIX "/share/xiv/xiv.ppm");
+            show_image(img, file);
+        }
+        free(file);
+        pthread_mutex_lock(&mutexCache);
+    }
+    pthread_mutex_unlock(&mutexCache);
+    return 0;
+}
+
+// Upgrade the current image if needed
+void upgrade_current()
+{
+    view_state v;
+    hold_view(v);
+    Image *img = v.img;
+    if (img && img->upgrade == UPGRADE_WANTED)
+        upgrade_image(img);
+    release_image(img);
+}
+
+// Upgrade thread, decodes the current image at full resolution as soon as it's shown reduced
+// or the view leaves its decoded region, without waiting for the prefetch workers
+void *async_upgrade(void *)
+{
+    set_thread_cpus(&loadCpus);
+    set_thread_background();
+
+    while (nbfiles > 0) {
+        upgrade_current();
+        MutexProtect mp(&mutexCache);
+        view_state v;
+        read_view(v);
+        if (nbfiles > 0 && (v.img == 0 || v.img->upgrade != UPGRADE_WANTED))
+            pthread_cond_wait(&condUpgrade, &mutexCache);
+    }
+    return 0;
+}
+
+// Next image of the window to prefetch, 0 when the window is loaded or would not fit in the
+// cache budget: the images of the window are kept the most recently used, the nearest last,
+// and an image is only loaded if one more of the average size of the window fits.
+// Called with mutexCache locked.
+const char *prefetch_next()
+{
+    size_t bytes = 0;
+    int loaded = 0;
+    const char *next = 0;
+    for (int k = 0; k < prefetchLen; k++) {
+        const char *file = files[prefetchWindow[k]];
+        Image *img = find_image(file);
+        // Images compressed out of the window are uncompressed by load_image()
+        if (img && (img->packed == 0 || img->state != READY)) {
+            if (img->state == READY) {
+                bytes += img->bytes;
+                loaded++;
+            }
+            continue;
+        }
+        bool busy = false;
+        for (int i = 0; i < prefetchThreads; i++)
+            busy = busy || (prefetching[i] && 0 == strcmp(prefetching[i], file));
+        if (!busy && next == 0 && (loaded == 0 || bytes + bytes / loaded <= cacheBytes))
+            next = file;
     }
+    for (int k = prefetchLen - 1; k >= 0; k--) {
+        Image *img = find_image(files[prefetchWindow[k]]);
+        if (img && img->state == READY)
+            touch_image(img);
+    }
+    return next;
 }
 
-void *async_load(void *)
+// Prefetch worker, loads the images of the window around the current one in the background
+void *async_load(void *arg)
 {
-    while (nbfiles > 1) {
-        // Ensure the next image in the list is preloaded in the cache
-        for (int s = 0; s <= 1; s++) {
-            bool found = false;
-            int next = 0;
-            {
-                MutexProtect mp(&mutexCache);
-                // Preload next file
-                if (nbfiles > 0) {
-                    next = (idxfile + s) % nbfiles;
-                    // Search if it's already in the cache
-                    for (int i = 0; i < CACHE_NBIMAGES; i++) {
-                        if (imgCache[i]
-                            && 0 ==
-                            strcmp(imgCache[i]->name,
-                               files[next])) {
-                            found = true;
-                            break;
-                        }
-                    }
+    int n = (int)(intptr_t)arg;
+    // Keep decoding out of the way of drawing and sync threads
+    set_thread_cpus(&loadCpus);
+    set_thread_background();
+
+    while (nbfiles > 0) {
+        bool pressure = memory_pressure();
+        char *file = 0;
+        {
+            MutexProtect mp(&mutexCache);
+            // Short of memory, only keep the images in use and don't prefetch
+            if (pressure)
+                trim_cache(0, 0);
+            else if (nbfiles > 0) {
+                const char *next = prefetch_next();
+                if (next)
+                    file = prefetching[n] = strdup(next);
+            }
+            if (file == 0) {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += 200000000;
+                if (ts.tv_nsec >= 1000000000) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000;
                 }
+                pthread_cond_timedwait(&condPrefetch, &mutexCache, &ts);
+                continue;
             }
+        }
+        if (verbose)
+            fprintf(stderr, "Prefetch %s\n", file);
+        release_image(load_image(file));
+        if (verbose)
+            fprintf(stderr, "Prefetch of %s done\n", file);
+        MutexProtect mp(&mutexCache);
+        prefetching[n] = 0;
+        free(file);
+    }
+    return 0;
+}
 
-            if (!found) {
-                if (verbose)
-                    fprintf(stderr,
-                        "Preload next image %s\n",
-                        files[next]);
-                load_image(files[next]);
-                if (verbose)
-                    fprintf(stderr, "Preload done\n");
-            }
-            usleep(200000);
+// Next image to compress: the most recently used one which is neither held, nor in the
+// prefetch window, nor wanted. Called with mutexCache locked.
+Image *pack_next()
+{
+    for (Image *img = cacheFirst; img; img = img->next) {
+        if (img->refs == 0 && img->state == READY && img->buf && img->map == 0
+            && !img->incompressible && !load_wanted(img->name))
+            return img;
+    }
+    return 0;
+}
+
+// Compresses the rasters of the cached images which left the prefetch window with LZ4, so that
+// going back to them costs uncompressing rather than decoding and more of them fit in the cache.
+// Rasters which it doesn't reduce by a quarter are left as they are.
+void *async_pack(void *)
+{
+    set_thread_cpus(&loadCpus);
+    set_thread_background();
+
+    pthread_mutex_lock(&mutexCache);
+    while (nbfiles > 0) {
+        Image *img = pack_next();
+        if (img == 0) {
+            pthread_cond_wait(&condPrefetch, &mutexCache);
+            continue;
+        }
+        // Loaders wait for it to be compressed
+        img->state = IN_PROGRESS;
+        img->refs++;
+        pthread_mutex_unlock(&mutexCache);
+        size_t len = raster_bytes(img), packedLen = 0;
+        unsigned char *packed = pack_raster(img->buf, len, len - len / 4, packedLen);
+        pthread_mutex_lock(&mutexCache);
+        if (packed) {
+            if (verbose)
+                fprintf(stderr, "Compressed %s to %d%%\n", img->name, (int)(100 * packedLen / len));
+            free(img->buf);
+            img->buf = 0;
+            // Built again from the uncompressed raster
+            free(img->proxy);
+            img->proxy = 0;
+            img->packed = packed;
+            img->packedLen = packedLen;
+            img->bytes = image_bytes(img);
+        } else
+            img->incompressible = true;
+        img->state = READY;
+        img->cancel = false;
+        pthread_cond_broadcast(&condCache);
+        if (--img->refs == 0 && !img->cached)
+            delete img;
+    }
+    pthread_mutex_unlock(&mutexCache);
+    return 0;
+}
+
+// Writes the rasters queued by store_image() to diskCache
+void *async_store(void *)
+{
+    set_thread_cpus(&loadCpus);
+    set_thread_background();
+
+    pthread_mutex_lock(&mutexCache);
+    while (nbfiles > 0) {
+        if (storeLen == 0) {
+            pthread_cond_wait(&condStore, &mutexCache);
+            continue;
         }
+        Image *img = storeQueue[0];
+        memmove(storeQueue, storeQueue + 1, --storeLen * sizeof(Image *));
+        pthread_mutex_unlock(&mutexCache);
+        struct shared_raster r;
+        image_raster(img, r);
+        disk_store(img->name, r, img->buf);
+        release_image(img);
+        pthread_mutex_lock(&mutexCache);
     }
+    pthread_mutex_unlock(&mutexCache);
     return 0;
 }
 
@@ -1145,6 +2282,8 @@ void *udp_handler(void *) {
     struct ip_mreq mreq;
     bool new_image = false;
 
+    set_thread_priority(syncPrio);
+
     recv_socket = socket(AF_INET, SOCK_DGRAM, 0);
     if (recv_socket == 0) {
         perror("Couldn't open receiving socket");
@@ -1192,25 +2331,41 @@ void *udp_handler(void *) {
     while (1) {
         if (read(recv_socket, &data, sizeof(sync_struct)) >= (ssize_t) sizeof(sync_struct) &&
             data.flag == 1234) {
+            // Only the last of the queued positions matters, so that images the master
+            // skipped are not loaded
+            sync_struct last;
+            while (recv(recv_socket, &last, sizeof(sync_struct), MSG_DONTWAIT) >= (ssize_t) sizeof(sync_struct)) {
+                if (last.flag == 1234)
+                    data = last;
+            }
             // Do something here with what we've received
             if (verbose) {
                 fprintf(stderr, "%d, %d, %f, %f, %f\n", data.img_idx, data.flag, data.dx, data.dy, data.z);
             }
 
+            if (data.img_idx >= nbfiles || data.img_idx < 0) {
+                fprintf(stderr, "ERROR: Tried to cycle past the end of the image list (idxfile = %d, nbfiles = %d). Is the list of images on your command line identical to the master, and do all the images actually exist?\n", data.img_idx, nbfiles);
+                exit(1);
+            }
             pthread_mutex_lock(&mutexData);
             new_image = (idxfile != data.img_idx);
-            dx = data.dx;
-            dy = data.dy;
-            z = data.z;
             idxfile = data.img_idx;
-            pthread_mutex_unlock(&mutexData);
-            if (new_image) {
-                if (data.img_idx >= nbfiles || data.img_idx < 0) {
-                    fprintf(stderr, "ERROR: Tried to cycle past the end of the image list (idxfile = %d, nbfiles = %d). Is the list of images on your command line identical to the master, and do all the images actually exist?\n", data.img_idx, nbfiles);
-                    exit(1);
-                }
+            // The master sends the new index with the position of its previous image,
+            // the image is fitted as the master does
+            if (new_image)
                 display_image(files[data.img_idx]);
+            // Later positions are the ones of the image being loaded, if any
+            else if (loadingFile) {
+                posPending = true;
+                posDx = data.dx;
+                posDy = data.dy;
+                posZ = data.z;
+            } else {
+                dx = data.dx;
+                dy = data.dy;
+                z = data.z;
             }
+            unlock_view();
         }
     }
     return 0;
@@ -1228,26 +2383,27 @@ void *send_coords(void *) {
         return 0;
     }
 
+    set_thread_priority(syncPrio);
+
     a.flag = 1234;
 
-    pthread_mutex_lock(&mutexData);
-    a.dx = dx;
-    a.dy = dy;
-    a.z = z;
-    a.img_idx = idxfile;
-    pthread_mutex_unlock(&mutexData);
+    view_state v;
+    read_view(v);
+    a.dx = v.dx;
+    a.dy = v.dy;
+    a.z = v.z;
+    a.img_idx = v.idx;
 
     while(run) {
-        pthread_mutex_lock(&mutexData);
-        if (dx != a.dx || dy != a.dy || z != a.z || idxfile != a.img_idx) {
-            a.dx = dx;
-            a.dy = dy;
-            a.z = z;
-            a.img_idx = idxfile;
+        read_view(v);
+        if (v.dx != a.dx || v.dy != a.dy || v.z != a.z || v.idx != a.img_idx) {
+            a.dx = v.dx;
+            a.dy = v.dy;
+            a.z = v.z;
+            a.img_idx = v.idx;
             update_needed = true;
         } else
             update_needed = false;
-        pthread_mutex_unlock(&mutexData);
 
         if (update_needed) {
             if (num_sockets == 0) {
@@ -1300,68 +2456,6 @@ void *send_coords(void *) {
     } return 0;
 }
 
-void translate(float stepX, float stepY)
-{
-    float xp = dx - (-z * cos(a) * stepX - z * sin(a) * stepY);
-    float yp = dy - (-z * sin(a) * stepX + z * cos(a) * stepY);
-
-    // Constrain dy so that no black bars show up above or below the image
-    if (imgCurrent) {
-        if (yp < 0) yp = 0;
-        else if (yp > imgCurrent->h - h * z) yp = imgCurrent->h - h*z;
-
-        if (h360) {
-            // Wrap-around
-            if (xp > imgCurrent->w)
-                xp -= imgCurrent->w;
-            else if (xp < -imgCurrent->w)
-                xp += imgCurrent->w;
-        } else {
-            if (xp > imgCurrent->w - 10)
-                xp = imgCurrent->w - 10;
-            if (xp / z < -w + 10)
-                xp = (10 -w) * z;
-        }
-    }
-    dx = xp;
-    dy = yp;
-}
-
-void zoom(float zf)
-{
-    float xp = z * cos(a) * w / 2 - z * sin(a) * h / 2 + dx;
-    float yp = z * sin(a) * h / 2 + z * cos(a) * h / 2 + dy;
-
-    // Constrain zoom amount
-    if (zf < minz) zf = minz;
-    if (zf > maxz) zf = maxz;
-
-    xp = xp - (zf * cos(a) * w / 2 - zf * sin(a) * h / 2);
-    yp = yp - (zf * sin(a) * w / 2 + zf * cos(a) * h / 2);
-
-    // Constrain dy so that no black bars show up above or below the image
-    if (imgCurrent) {
-        if (yp < 0) yp = 0;
-        else if (yp > imgCurrent->h - h * zf) yp = imgCurrent->h - h*zf;
-    
-        if (h360) {
-            // Wrap-around
-            if (xp > imgCurrent->w)
-                xp -= imgCurrent->w;
-            else if (xp < -imgCurrent->w)
-                xp += imgCurrent->w;
-        } else {
-            if (xp > imgCurrent->w - 10)
-                xp = imgCurrent->w - 10;
-            if (xp / z < -w + 10)
-                xp = (10 -w) * z;
-        }
-    }
-    z = zf;
-    dx = xp;
-    dy = yp;
-}
-
 // Display next image
 void next_image(int step)
 {
@@ -1373,7 +2467,44 @@ void next_image(int step)
     if (idxfile < 0)
         idxfile = nbfiles - 1;
     display_image(files[idxfile]);
-    pthread_mutex_unlock(&mutexData);
+    unlock_view();
+}
+
+// Delete the current image, or rename it to file.del if keep is set, and display the next one.
+// The last one is replaced by the default image so that xiv keeps running.
+void remove_image(bool keep)
+{
+    pthread_mutex_lock(&mutexData);
+    if (nbfiles == 0 || 0 == strcmp(files[idxfile], PREFIX "/share/xiv/xiv.ppm")) {
+        pthread_mutex_unlock(&mutexData);
+        return;
+    }
+    if (keep) {
+        // Append .del to filename and rename file to it
+        // The file is not actually deleted.
+        char *tmp = (char *)malloc(strlen(files[idxfile]) + 5);
+        sprintf(tmp, "%s.del", files[idxfile]);
+        rename(files[idxfile], tmp);
+        free(tmp);
+    } else
+        unlink(files[idxfile]);
+    {
+        // Prefetch workers read the files of the window
+        MutexProtect mp(&mutexCache);
+        free(files[idxfile]);
+        if (nbfiles == 1)
+            files[0] = strdup(PREFIX "/share/xiv/xiv.ppm");
+        else {
+            nbfiles--;
+            for (int i = idxfile; i < nbfiles; i++)
+                files[i] = files[i + 1];
+        }
+        if (idxfile >= nbfiles)
+            idxfile = 0;
+        update_window();
+    }
+    display_image(files[idxfile]);
+    unlock_view();
 }
 
 #ifdef WATCHDOG
@@ -1408,6 +2539,8 @@ void *spacenav_handler(void *)
 {
     spnav_event spev;
 
+    set_thread_priority(syncPrio);
+
     if (!init_spacenav(spdev == NULL ? "/dev/input/spacenavigator" : spdev)) {
         pthread_exit(0);
     }
@@ -1422,7 +2555,7 @@ void *spacenav_handler(void *)
                     pthread_mutex_lock(&mutexData);
                     zoom(z - z * spev.z / 350.0 / spsens / 2);
                     translate(swapaxes * -1 * spev.x / spsens, swapaxes * spev.y / spsens);
-                    pthread_mutex_unlock(&mutexData);
+                    unlock_view();
                 } else {
                     // value == 0  means the button is coming up. Without this, it
                     // would cycle images both on press *and* on release, which
@@ -1456,32 +2589,28 @@ void *async_fifo(void *)
                 printf("msg: [%s]\n", msg);
                 if (strstr(msg, "l ") == msg) {
                     pthread_mutex_lock(&mutexData);
-                    display_image(msg + 2);
-                    pthread_mutex_unlock(&mutexData);
-                } else if (strstr(msg, "z") == msg) {
-                    float zc = atof(msg + 2);
-                    pthread_mutex_lock(&mutexData);
-                    if (zc <= 0) {
-                        full_extend();
-                    } else {
-                        zoom(zc);
+                    // Prefetch around the image if it's one of the files
+                    for (int i = 0; i < nbfiles; i++) {
+                        if (0 == strcmp(files[i], msg + 2)) {
+                            idxfile = i;
+                            break;
+                        }
                     }
-                    pthread_mutex_unlock(&mutexData);
-                } else if (strstr(msg, "c") == msg) {
-                    int xp, yp;
-                    sscanf(msg, "c %d %d\n", &xp, &yp);
-                    pthread_mutex_lock(&mutexData);
-                    dx = xp - (z * cos(a) * (w / 2) -
-                           z * sin(a) * (h / 2));
-                    dy = yp - (z * sin(a) * (w / 2) +
-                           z * cos(a) * (h / 2));
-                    pthread_mutex_unlock(&mutexData);
-                } else if (strstr(msg, "m") == msg) {
-                    int dxp, dyp;
-                    sscanf(msg, "m %d %d\n", &dxp, &dyp);
+                    display_image(msg + 2);
+                    unlock_view();
+                } else if (strstr(msg, "z") == msg || strstr(msg, "c") == msg
+                           || strstr(msg, "m") == msg) {
                     pthread_mutex_lock(&mutexData);
-                    translate(dxp, dyp);
-                    pthread_mutex_unlock(&mutexData);
+                    // Moves the image being loaded once it's shown
+                    if (loadingFile) {
+                        char **moves = (char **)realloc(movesPending, (movesLen + 1) * sizeof(char *));
+                        if (moves) {
+                            movesPending = moves;
+                            movesPending[movesLen++] = strdup(msg);
+                        }
+                    } else
+                        fifo_move(msg);
+                    unlock_view();
                 } else if (strstr(msg, "q") == msg) {
                     close(fd);
                     unlink(fifo);
@@ -1495,6 +2624,35 @@ void *async_fifo(void *)
     return 0;
 }
 
+// Exit on the signals which end xiv, so that the atexit() handlers run
+void *async_signals(void *)
+{
+    int sig;
+    if (sigwait(&exitSignals, &sig) == 0) {
+        if (verbose)
+            fprintf(stderr, "Signal %d, exiting\n", sig);
+        exit(0);
+    }
+    return 0;
+}
+
+// Stop the switching thread before the window is destroyed, cancelling the image it loads
+void stop_display()
+{
+    {
+        MutexProtect mp(&mutexCache);
+        if (displayStopped)
+            return;
+        displayStopped = true;
+        Image *img = wantedFile ? find_image(wantedFile) : 0;
+        if (img && img->state == IN_PROGRESS)
+            img->cancel = true;
+        pthread_cond_broadcast(&condDisplay);
+    }
+    void *r;
+    pthread_join(thDisplay, &r);
+}
+
 void quit()
 {
     void *r;
@@ -1519,7 +2677,20 @@ void quit()
     pthread_cancel(thWatchdog);
     pthread_join(thWatchdog, &r);
     #endif
-    pthread_join(thPreload, &r);
+    pthread_mutex_lock(&mutexCache);
+    pthread_cond_broadcast(&condPrefetch);
+    pthread_cond_broadcast(&condDisplay);
+    pthread_cond_broadcast(&condStore);
+    pthread_cond_broadcast(&condUpgrade);
+    pthread_mutex_unlock(&mutexCache);
+    for (int i = 0; i < prefetchThreads; i++)
+        pthread_join(thPreload[i], &r);
+    pthread_join(thUpgrade, &r);
+    stop_display();
+    if (diskCache)
+        pthread_join(thStore, &r);
+    if (packCache)
+        pthread_join(thPack, &r);
     pthread_join(th, &r);
 }
 
@@ -1611,6 +2782,9 @@ int main(int argc, char **argv)
         exit(1);
     }
 
+    CPU_ZERO(&fillCpus);
+    CPU_ZERO(&loadCpus);
+
     // Analyse arguments
     for (int i = 1; i < argc; i++) {
         if (0 == strcmp(argv[i], "-geometry")) {
@@ -1632,6 +2806,8 @@ int main(int argc, char **argv)
             }
         } else if (0 == strcmp(argv[i], "-no-autorot")) {
             autorot = false;
+        } else if (0 == strcmp(argv[i], "-no-preview")) {
+            preview = false;
         } else if (0 == strcmp(argv[i], "-fullscreen")) {
             fullscreen = true;
         } else if (0 == strcmp(argv[i], "-overview")) {
@@ -1765,6 +2941,10 @@ int main(int argc, char **argv)
                 usage(argv[0]);
                 exit(1);
             }
+        } else if (0 == strcmp(argv[i], "-roi")) {
+            roi = true;
+        } else if (0 == strcmp(argv[i], "-screenres")) {
+            needRes = true;
         } else if (0 == strcmp(argv[i], "-bilinear")) {
             bilin = true;
         } else if (0 == strcmp(argv[i], "-v")) {
@@ -1776,6 +2956,43 @@ int main(int argc, char **argv)
                 usage(argv[0]);
                 exit(1);
             }
+        } else if (0 == strcmp(argv[i], "-fillcpus")) {
+            if ((i + 1) >= argc || !parse_cpulist(argv[++i], &fillCpus)) {
+                usage(argv[0]);
+                exit(1);
+            }
+        } else if (0 == strcmp(argv[i], "-loadcpus")) {
+            if ((i + 1) >= argc || !parse_cpulist(argv[++i], &loadCpus)) {
+                usage(argv[0]);
+                exit(1);
+            }
+        } else if (0 == strcmp(argv[i], "-loadthreads")) {
+            if ((i + 1) < argc)
+                sscanf(argv[++i], "%d", &loadThreads);
+            else {
+                usage(argv[0]);
+                exit(1);
+            }
+        } else if (0 == strcmp(argv[i], "-prefetch")) {
+            if ((i + 1) >= argc
+                || sscanf(argv[++i], "%d,%d", &prefetchAhead, &prefetchBehind) < 1
+                || prefetchAhead < 0 || prefetchBehind < 0) {
+                usage(argv[0]);
+                exit(1);
+            }
+        } else if (0 == strcmp(argv[i], "-prefetchthreads")) {
+            if ((i + 1) >= argc || sscanf(argv[++i], "%d", &prefetchThreads) != 1
+                || prefetchThreads < 1) {
+                usage(argv[0]);
+                exit(1);
+            }
+        } else if (0 == strcmp(argv[i], "-syncprio")) {
+            if ((i + 1) < argc)
+                sscanf(argv[++i], "%d", &syncPrio);
+            else {
+                usage(argv[0]);
+                exit(1);
+            }
         } else if (0 == strcmp(argv[i], "-cache")) {
             if ((i + 1) < argc)
                 sscanf(argv[++i], "%d", &CACHE_NBIMAGES);
@@ -1783,6 +3000,49 @@ int main(int argc, char **argv)
                 usage(argv[0]);
                 exit(1);
             }
+        } else if (0 == strcmp(argv[i], "-cachemem")) {
+            int mb;
+            if ((i + 1) < argc && sscanf(argv[++i], "%d", &mb) == 1 && mb > 0)
+                cacheBytes = (size_t)mb << 20;
+            else {
+                usage(argv[0]);
+                exit(1);
+            }
+        } else if (0 == strcmp(argv[i], "-no-pack")) {
+            packCache = false;
+        } else if (0 == strcmp(argv[i], "-shared")) {
+            sharedCache = true;
+        } else if (0 == strcmp(argv[i], "-diskcache")) {
+            if ((i + 1) < argc)
+                diskCache = argv[++i];
+            else {
+                usage(argv[0]);
+                exit(1);
+            }
+        } else if (0 == strcmp(argv[i], "-diskcachemem")) {
+            int mb;
+            if ((i + 1) < argc && sscanf(argv[++i], "%d", &mb) == 1 && mb > 0)
+                diskBytes = (size_t)mb << 20;
+            else {
+                usage(argv[0]);
+                exit(1);
+            }
+        } else if (0 == strcmp(argv[i], "-tilecache")) {
+            int mb;
+            if ((i + 1) < argc && sscanf(argv[++i], "%d", &mb) == 1 && mb > 0)
+                Tiles::budget = (size_t)mb << 20;
+            else {
+                usage(argv[0]);
+                exit(1);
+            }
+        } else if (0 == strcmp(argv[i], "-virtual")) {
+            int mb;
+            if ((i + 1) < argc && sscanf(argv[++i], "%d", &mb) == 1 && mb > 0)
+                virtualMin = (size_t)mb << 20;
+            else {
+                usage(argv[0]);
+                exit(1);
+            }
         } else if (0 == strcmp(argv[i], "-fifo")) {
             if ((i + 1) < argc)
                 fifo = argv[++i];
@@ -1851,6 +3111,27 @@ int main(int argc, char **argv)
         normal = XCreateFontCursor(display, XC_left_ptr);
     }
 
+    // Size the image cache
+    {
+        MutexProtect mp(&mutexCache);
+        if (cacheBytes == 0)
+            cacheBytes = memory_limit() / 2;
+    }
+    if (sharedCache && shared_open(cacheBytes)) {
+        // The last xiv leaving the shared cache removes it, also when killed: the signals
+        // which end xiv are handled by a thread, before any other thread is created.
+        atexit(shared_close);
+        sigemptyset(&exitSignals);
+        sigaddset(&exitSignals, SIGTERM);
+        sigaddset(&exitSignals, SIGINT);
+        sigaddset(&exitSignals, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &exitSignals, NULL);
+        pthread_create(&thSignals, NULL, async_signals, 0);
+    } else
+        sharedCache = false;
+    if (diskCache && !disk_open(diskCache, diskBytes))
+        diskCache = 0;
+
     if (spacenav) {
         pthread_create(&thSpacenav, NULL, spacenav_handler, 0);
     }
@@ -1859,18 +3140,6 @@ int main(int argc, char **argv)
     } else if (num_slaves > 0) {
         pthread_create(&thUDPMaster, NULL, send_coords, 0);
     }
-    // Create the image cache.
-    {
-        MutexProtect mp(&mutexCache);
-        imgCache = (Image **) malloc(CACHE_NBIMAGES * sizeof(Image *));
-        if (imgCache == NULL) {
-            fprintf(stderr, "Not enough memory\n");
-            exit(1);
-        }
-        for (int i = 0; i < CACHE_NBIMAGES; i++) {
-            imgCache[i] = 0;
-        }
-    }
 
     // No files and no fifo, display usage and exit
     if (nbfiles == 0 && fifo == NULL) {
@@ -1947,18 +3216,10 @@ int main(int argc, char **argv)
     }
     // Try to detect number of cores
     if (ncores == 0) {
-        FILE *f = fopen("/proc/cpuinfo", "r");
-        char tmp[1024];
-        if (fgets(tmp, 1024, f)) {
-            while (!feof(f)) {
-                if (strstr(tmp, "processor") == tmp)
-                    ncores++;
-                if (!fgets(tmp, 1024, f)) break;
-            }
-        }
-        fclose(f);
-        if (ncores == 0)
-            ncores = 1;
+        if (CPU_COUNT(&fillCpus) > 0)
+            ncores = CPU_COUNT(&fillCpus);
+        else
+            ncores = count_cpus();
     }
     // If several cores are available, create variables for multithreaded drawing
     if (ncores > 1 && !fakewin) {
@@ -1968,6 +3229,29 @@ int main(int argc, char **argv)
             fprintf(stderr, "Not enough memory\n");
             exit(1);
         }
+        // Pin each drawing thread to its own core if requested
+        if (CPU_COUNT(&fillCpus) > 0) {
+            fillAttr = (pthread_attr_t *) malloc(ncores * sizeof(pthread_attr_t));
+            if (fillAttr == NULL) {
+                fprintf(stderr, "Not enough memory\n");
+                exit(1);
+            }
+            for (int i = 0; i < ncores; i++) {
+                cpu_set_t cpu;
+                CPU_ZERO(&cpu);
+                CPU_SET(nth_cpu(&fillCpus, i), &cpu);
+                pthread_attr_init(fillAttr + i);
+                pthread_attr_setaffinity_np(fillAttr + i, sizeof(cpu_set_t), &cpu);
+            }
+        }
+    }
+    if (virtualMin == 0)
+        virtualMin = memory_limit() / 4;
+    if (loadThreads == 0) {
+        if (CPU_COUNT(&loadCpus) > 0)
+            loadThreads = CPU_COUNT(&loadCpus);
+        else
+            loadThreads = count_cpus();
     }
     if (verbose)
         fprintf(stderr, "%d core(s).\n", ncores);
@@ -2009,6 +3293,8 @@ int main(int argc, char **argv)
     bilin = true;
 
     gm = 1.1;
+    pthread_mutex_lock(&mutexData);
+    unlock_view();
     for (int i = 0; i < 30; i++) {
         fill();
     }
@@ -2016,6 +3302,8 @@ int main(int argc, char **argv)
     printf("GM=%f NB=%d %ds\n", gm, imgCurrent->nb, time(NULL) - debut);
     debut = time(NULL);
     gm = 1;
+    pthread_mutex_lock(&mutexData);
+    unlock_view();
 
     for (int i = 0; i < 30; i++) {
         fill();
@@ -2044,10 +3332,26 @@ int main(int argc, char **argv)
         // Normally done on first window resize
         pthread_mutex_lock(&mutexData);
         display_image(files[idxfile]);
-        pthread_mutex_unlock(&mutexData);
+        unlock_view();
     }
 
-    pthread_create(&thPreload, NULL, async_load, 0);
+    thPreload = (pthread_t *) malloc(prefetchThreads * sizeof(pthread_t));
+    prefetching = (char **) calloc(prefetchThreads, sizeof(char *));
+    if (thPreload == NULL || prefetching == NULL) {
+        fprintf(stderr, "Not enough memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < prefetchThreads; i++)
+        pthread_create(thPreload + i, NULL, async_load, (void *)(intptr_t) i);
+    pthread_create(&thDisplay, NULL, async_display, 0);
+    pthread_create(&thUpgrade, NULL, async_upgrade, 0);
+    if (diskCache)
+        pthread_create(&thStore, NULL, async_store, 0);
+    #ifndef HAVE_LIBLZ4
+    packCache = false;
+    #endif
+    if (packCache)
+        pthread_create(&thPack, NULL, async_pack, 0);
 
     #ifdef WATCHDOG
         pthread_create(&thWatchdog, NULL, watchdog_handler, 0);
@@ -2091,14 +3395,11 @@ int main(int argc, char **argv)
                     event.xconfigure.height, image == NULL);
             if (w != event.xconfigure.width
                 || h != event.xconfigure.height || image == NULL) {
-                if (image != NULL) {
+                bool first = image == NULL;
+                if (!first) {
                     pthread_mutex_lock(&mutexWin);
                     XDestroyImage(image);    // This destroys the data pointer as well.
                     pthread_mutex_unlock(&mutexWin);
-                } else {
-                    pthread_mutex_lock(&mutexData);
-                    display_image(files[idxfile]);
-                    pthread_mutex_unlock(&mutexData);
                 }
 
                 // Keep image centered
@@ -2122,7 +3423,15 @@ int main(int argc, char **argv)
                     XCreateImage(display, visual, depth,
                          ZPixmap, 0, (char *)data, w, h,
                          32, 0);
-                pthread_mutex_unlock(&mutexData);
+                unlock_view();
+
+                // The first image is loaded for the size of the window, the current one
+                // again if it was decoded too coarse for the new size
+                if (first || (needRes && rescale_cache())) {
+                    pthread_mutex_lock(&mutexData);
+                    display_image(files[idxfile]);
+                    unlock_view();
+                }
 
                 //pixmap = XCreatePixmap(display, window, w, h, depth);
             }
@@ -2167,7 +3476,7 @@ int main(int argc, char **argv)
 
             dx = xp - (z * cos(a) * wx - z * sin(a) * wy);
             dy = yp - (z * sin(a) * wx + z * cos(a) * wy);
-            pthread_mutex_unlock(&mutexData);
+            unlock_view();
         } else if (!slavemode && event.type == ButtonPress
             && event.xbutton.button == Button5) {
             // Wheel Backward
@@ -2201,7 +3510,7 @@ int main(int argc, char **argv)
 
             dx = xp - (z * cos(a) * wx - z * sin(a) * wy);
             dy = yp - (z * sin(a) * wx + z * cos(a) * wy);
-            pthread_mutex_unlock(&mutexData);
+            unlock_view();
         } else if (!slavemode && event.type == ButtonPress
             && event.xbutton.button == Button1) {
             // Left is down
@@ -2262,7 +3571,7 @@ int main(int argc, char **argv)
                         z * sin(a) * (h / 2));
                     dy = yp - (z * sin(a) * (w / 2) +
                         z * cos(a) * (h / 2));
-                    pthread_mutex_unlock(&mutexData);
+                    unlock_view();
                 } else if (m & ShiftMask && zx1 > zx2
                     && zy1 > zy2) {
                     pthread_mutex_lock(&mutexData);
@@ -2288,7 +3597,7 @@ int main(int argc, char **argv)
                         z * sin(a) * (h / 2));
                     dy = yp - (z * sin(a) * (w / 2) +
                         z * cos(a) * (h / 2));
-                    pthread_mutex_unlock(&mutexData);
+                    unlock_view();
                 }
             }
 
@@ -2309,7 +3618,7 @@ int main(int argc, char **argv)
                 pthread_mutex_lock(&mutexData);
                 dx = xp - (z * cos(a) * wx - z * sin(a) * wy);
                 dy = yp - (z * sin(a) * wx + z * cos(a) * wy);
-                pthread_mutex_unlock(&mutexData);
+                unlock_view();
             }
         } else if (event.type == KeyPress) {
             char c[11];
@@ -2348,18 +3657,18 @@ int main(int argc, char **argv)
                     dy = yp - (z * sin(a) * w / 2 +
                         z * cos(a) * h / 2);
 
-                    pthread_mutex_unlock(&mutexData);
+                    unlock_view();
                 }
                 if (0 == strcmp(c, "+") || 0 == strcmp(c, "z"))    // Zoom keep center view
                 {
                     pthread_mutex_lock(&mutexData);
                     zoom(z / 1.5);
-                    pthread_mutex_unlock(&mutexData);
+                    unlock_view();
                 } else if (0 == strcmp(c, "-") || 0 == strcmp(c, "Z"))    // Unzoom keep center view
                 {
                     pthread_mutex_lock(&mutexData);
                     zoom(z * 1.5);
-                    pthread_mutex_unlock(&mutexData);
+                    unlock_view();
                 } else if (0 == strcmp(c, "/") || 0 == strcmp(c, "*"))    // Rotate PI/2
                 {
                     pthread_mutex_lock(&mutexData);
@@ -2374,7 +3683,7 @@ int main(int argc, char **argv)
                     else
                         fa = (n - 1) * M_PI / 2;
                     rotate(fa);
-                    pthread_mutex_unlock(&mutexData);
+                    unlock_view();
                 } else if (0 == strcmp(c, " ") || 0 == strcmp(c, "."))    // Center on current pointer position
                 {
                     pthread_mutex_lock(&mutexData);
@@ -2385,7 +3694,7 @@ int main(int argc, char **argv)
                         z * sin(a) * (h / 2));
                     dy = yp - (z * sin(a) * (w / 2) +
                         z * cos(a) * (h / 2));
-                    pthread_mutex_unlock(&mutexData);
+                    unlock_view();
                 } else if (0 == strcmp(c, "s")) {
                     displayPts = !displayPts;
                     refresh = true;
@@ -2400,18 +3709,22 @@ int main(int argc, char **argv)
                     pthread_mutex_unlock(&mutexWin);
                 } else if (0 == strcmp(c, "c") || 0 == strcmp(c, "C"))    // Contrast +/-
                 {
+                    pthread_mutex_lock(&mutexData);
                     if (0 == strcmp(c, "C"))
                         cr -= 8;
                     else
                         cr += 8;
                     if (cr <= 0)
                         cr = 1;
+                    unlock_view();
                 } else if (0 == strcmp(c, "g") || 0 == strcmp(c, "G"))    // Contrast +/-
                 {
+                    pthread_mutex_lock(&mutexData);
                     if (0 == strcmp(c, "g"))
                         gm *= 1.1;
                     else
                         gm /= 1.1;
+                    unlock_view();
                 } else if (0 == strcmp(c, "h"))    // Toggle display histogram
                 {
                     displayHist = !displayHist;
@@ -2429,61 +3742,59 @@ int main(int argc, char **argv)
                     bilin = !bilin;
                 } else if (0 == strcmp(c, "l") || 0 == strcmp(c, "L"))    // Luminosity +/-
                 {
+                    pthread_mutex_lock(&mutexData);
                     if (0 == strcmp(c, "l"))
                         lu += 8;
                     else
                         lu -= 8;
+                    unlock_view();
                 } else if (0 == strcmp(c, "v"))    // Reset Luminosity/Contrast
                 {
+                    pthread_mutex_lock(&mutexData);
                     lu = 0;
                     cr = 255;
                     gm = 1;
+                    unlock_view();
                 } else if (0 == strcmp(c, "i"))    // Invert radiometry
                 {
+                    pthread_mutex_lock(&mutexData);
                     revert = !revert;
+                    unlock_view();
                 } else if (0 == strcmp(c, "=") || 0 == strcmp(c, "r") || 0 == strcmp(c, "0"))    // Reset view
                 {
                     pthread_mutex_lock(&mutexData);
                     full_extend();
-                    pthread_mutex_unlock(&mutexData);
+                    unlock_view();
                 } else if (0 == strcmp(c, "n") || 0 == strcmp(c, "p") || 0 == strcmp(c, "N") || 0 == strcmp(c, "P"))    // next/previous image
                 {
+                    // Presses of the same key queued while the previous image was loading
+                    // are skipped at once
+                    int count = 1;
+                    XEvent ev;
+                    pthread_mutex_lock(&mutexWin);
+                    while (XCheckTypedWindowEvent(display, window, KeyPress, &ev)) {
+                        if (ev.xkey.keycode != event.xkey.keycode
+                            || ev.xkey.state != event.xkey.state) {
+                            XPutBackEvent(display, &ev);
+                            break;
+                        }
+                        count++;
+                    }
+                    pthread_mutex_unlock(&mutexWin);
                     if (0 == strcmp(c, "n"))
-                        next_image(1);
+                        next_image(count);
                     else if (0 == strcmp(c, "N"))
-                        next_image(nbfiles / 20);
+                        next_image(count * (nbfiles / 20));
                     else if (0 == strcmp(c, "p"))
-                        next_image(-1);
+                        next_image(-count);
                     else
-                        next_image(-nbfiles / 20);
+                        next_image(-count * (nbfiles / 20));
                 } else if (0 == strcmp(c, "D"))    // Delete image 
                 {
-                    if (nbfiles > 0) {
-                        unlink(files[idxfile]);
-                        free(files[idxfile]);
-                        nbfiles--;
-                        for (int i = idxfile; i < nbfiles; i++)
-                            files[i] = files[i + 1];
-                        next_image(0);
-                    }
+                    remove_image(false);
                 } else if (0 == strcmp(c, "d"))    // Move image to file.jpg.del so that you can undelete it.
                 {
-                    if (nbfiles > 0) {
-                        // Append .del to filename and rename file to it
-                        // The file is not actually deleted.
-                        char *tmp =
-                            (char *)
-                            malloc(strlen(files[idxfile]) + 5);
-                        tmp[0] = 0;
-                        sprintf(tmp, "%s.del", files[idxfile]);
-                        rename(files[idxfile], tmp);
-                        free(tmp);
-                        free(files[idxfile]);
-                        nbfiles--;
-                        for (int i = idxfile; i < nbfiles; i++)
-                            files[i] = files[i + 1];
-                        next_image(0);
-                    }
+                    remove_image(true);
                 } else if (ks == XK_Left)    // Key based Pan / Rotate
                 {
                     pthread_mutex_lock(&mutexData);
@@ -2498,7 +3809,7 @@ int main(int argc, char **argv)
                         else
                             translate(-w / 5, 0);
                     }
-                    pthread_mutex_unlock(&mutexData);
+                    unlock_view();
                 } else if (ks == XK_Right)    // Key based Pan / Rotate
                 {
                     pthread_mutex_lock(&mutexData);
@@ -2513,7 +3824,7 @@ int main(int argc, char **argv)
                         else
                             translate(w / 5, 0);
                     }
-                    pthread_mutex_unlock(&mutexData);
+                    unlock_view();
                 } else if (ks == XK_Up)    // Key based Pan Up
                 {
                     pthread_mutex_lock(&mutexData);
@@ -2521,7 +3832,7 @@ int main(int argc, char **argv)
                         translate(0, h / 20);
                     else
                         translate(0, h / 5);
-                    pthread_mutex_unlock(&mutexData);
+                    unlock_view();
                 } else if (ks == XK_Down)    // Key based Pan Down
                 {
                     pthread_mutex_lock(&mutexData);
@@ -2529,7 +3840,7 @@ int main(int argc, char **argv)
                         translate(0, -h / 20);
                     else
                         translate(0, -h / 5);
-                    pthread_mutex_unlock(&mutexData);
+                    unlock_view();
                 } else if (ks == XK_F1 || ks == XK_F2 || ks == XK_F3
                     || ks == XK_F4 || ks == XK_F5 || ks == XK_F6
                     || ks == XK_F7 || ks == XK_F8 || ks == XK_F9
@@ -2577,7 +3888,7 @@ int main(int argc, char **argv)
                             yp);
                     pts[2 * (idxp - 1) + 0] = xp;
                     pts[2 * (idxp - 1) + 1] = yp;
-                    pthread_mutex_unlock(&mutexData);
+                    unlock_view();
                     refresh = true;
                 }
             }
@@ -2590,10 +3901,12 @@ int main(int argc, char **argv)
 
     // Cleanup before leaving
     {
+        // It shows the image it loads in the window
+        stop_display();
         pthread_mutex_lock(&mutexData);
         if (image != NULL)
             XDestroyImage(image);
-        pthread_mutex_unlock(&mutexData);
+        unlock_view();
         if (!fakewin) {
             pthread_mutex_lock(&mutexWin);
             XDestroyWindow(display, window);
@@ -2614,16 +3927,22 @@ int main(int argc, char **argv)
         free(thFill);
     if (fillBounds != NULL)
         free(fillBounds);
+    if (fillAttr != NULL) {
+        for (int i = 0; i < ncores; i++)
+            pthread_attr_destroy(fillAttr + i);
+        free(fillAttr);
+    }
 
     for (int i = 0; i < nbfiles; i++)
         free(files[i]);
     free(files);
 
     MutexProtect mp(&mutexCache);
-    for (int i = 0; i < CACHE_NBIMAGES; i++) {
-        delete imgCache[i];
+    while (cacheFirst) {
+        Image *img = cacheFirst;
+        uncache_image(img);
+        delete img;
     }
-    free(imgCache);
 
     return 0;
 }
@@ -32,6 +32,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include "xiv_tiles.h"
 
 enum
   {
@@ -40,18 +42,62 @@ enum
     ERROR
   };
 
+// State of a raster which only covers part of the image
+enum
+  {
+    UPGRADE_NONE,     // Raster is complete or nobody needs more
+    UPGRADE_WANTED,   // The view needs the full raster
+    UPGRADE_DONE      // Full raster was loaded or can't be
+  };
+
 class Image{
 public:
- Image(int vw,int vh,int vnb,int vmax,int vnbits,const char* vname,unsigned char* vbuf=0) : w(vw),h(vh),nb(vnb),max(vmax),nbits(vnbits),buf(vbuf), name(strdup(vname)),state(IN_PROGRESS){}
+ Image(int vw,int vh,int vnb,int vmax,int vnbits,const char* vname,unsigned char* vbuf=0) : w(vw),h(vh),nb(vnb),max(vmax),nbits(vnbits),buf(vbuf), name(strdup(vname)),nc(3),state(IN_PROGRESS),map(0),mapLen(0),scale(1),bx(0),by(0),bw(vw),bh(vh),upgrade(UPGRADE_NONE),tiles(0),proxy(0),packed(0),packedLen(0),incompressible(false),orient(0),cancel(false),refs(0),cached(false),bytes(0),prev(0),next(0){}
   ~Image(){
-    if(buf!=NULL) free(buf);
+    if(map!=NULL) munmap(map,mapLen);
+    else if(buf!=NULL) free(buf);
+    free(proxy);
+    free(packed);
     if(name!=NULL) free(name);
+    delete tiles;
   }
   int w,h,nb,max;
   int nbits;
   unsigned char* buf;
   char* name;
+  // Samples per pixel of the raster, 3 or 1 for gray images. Tiles are always RGB.
+  int nc;
   int state;
+  // When the raster is read directly from a mapped file, buf points inside map
+  void* map;
+  size_t mapLen;
+  // Raster is the image reduced by scale, its pixel (i,j) is pixel (scale*i,scale*j) of the image.
+  // It covers [bx,bx+bw[ x [by,by+bh[ of the reduced image.
+  int scale;
+  int bx,by,bw,bh;
+  int upgrade;
+  // Tiled images have no raster, tiles are decoded when drawn
+  Tiles* tiles;
+  // 8 bits raster of 16 bits images drawn while contrast, luminosity and gamma are the
+  // default ones, as the 16 bits one would be. See make_proxy().
+  unsigned char* proxy;
+  // Raster compressed with LZ4 while the image is out of the prefetch window, buf is then 0.
+  // Rasters which LZ4 doesn't reduce enough are left as they are. See pack_image().
+  unsigned char* packed;
+  size_t packedLen;
+  bool incompressible;
+  // EXIF orientation, see read_orientation(). The raster and the tiles are kept as stored
+  // and turned when drawn, w and h are the size of the turned image while bx, by, bw
+  // and bh are in the stored one.
+  int orient;
+  // Set to stop loading an image which won't be shown, see want_image()
+  volatile bool cancel;
+  // Cache bookkeeping, protected by mutexCache (see hold_image()).
+  // An image is freed when it's neither held nor cached.
+  int refs;
+  bool cached;
+  size_t bytes;         // Memory of the decoded image counted in the cache budget
+  Image *prev,*next;    // Cache LRU, the most recently used first
 };
 
 
@@ -0,0 +1,249 @@
+#include "xiv_disk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+extern bool verbose;
+extern bool autorot;
+
+#define DISK_MAGIC "XIVDSK2"
+// The raster follows the header and the path of the image, page aligned so that it's mapped
+#define DISK_HEADER 4096
+#define DISK_SUFFIX ".xiv"
+// Files left by a process which died while writing them are removed after this many seconds
+#define DISK_STALE 3600
+
+struct disk_header {
+	char magic[8];
+	// Key: the image and its modification time
+	uint64_t size;
+	int64_t sec, nsec;
+	int32_t autorot;
+	int32_t pathLen;	// Length of the path which follows the header
+	uint64_t bytes;		// Length of the raster
+	struct shared_raster r;
+};
+
+// Cache file, for the LRU
+struct disk_file {
+	time_t used;
+	off_t size;
+	char *name;
+};
+
+static char *dir = 0;
+static size_t budget = 0;
+
+// Header of the cache file of image file, name is its path in the cache
+static bool file_key(const char *file, struct disk_header &k, char *abs, char *name, size_t len)
+{
+	struct stat st;
+	if (dir == 0 || stat(file, &st) != 0 || !S_ISREG(st.st_mode) || realpath(file, abs) == 0)
+		return false;
+	memset(&k, 0, sizeof(k));
+	memcpy(k.magic, DISK_MAGIC, sizeof(k.magic));
+	k.size = st.st_size;
+	k.sec = st.st_mtim.tv_sec;
+	k.nsec = st.st_mtim.tv_nsec;
+	k.autorot = autorot;
+	k.pathLen = strlen(abs);
+	if (sizeof(k) + k.pathLen > DISK_HEADER)
+		return false;
+	// FNV-1a hash of the path
+	uint64_t hash = 14695981039346656037ULL;
+	for (const char *c = abs; *c; c++)
+		hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+	snprintf(name, len, "%s/%016llx" DISK_SUFFIX, dir, (unsigned long long)hash);
+	return true;
+}
+
+// Open the cache file name if it stores the image of key k and abs, reading its header in h
+static int open_file(const char *name, const struct disk_header &k, const char *abs,
+		     struct disk_header &h)
+{
+	int fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	char path[DISK_HEADER];
+	struct stat st;
+	if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, k.magic, sizeof(h.magic)) != 0
+	    || h.size != k.size || h.sec != k.sec || h.nsec != k.nsec || h.autorot != k.autorot
+	    || h.pathLen != k.pathLen
+	    || pread(fd, path, h.pathLen, sizeof(h)) != h.pathLen || memcmp(path, abs, h.pathLen) != 0
+	    || h.bytes != (uint64_t)h.r.bw * h.r.bh * h.r.nc * h.r.nb
+	    || fstat(fd, &st) != 0 || (uint64_t)st.st_size < DISK_HEADER + h.bytes) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool write_all(int fd, const unsigned char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len > (1 << 24) ? 1 << 24 : len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+static int cmp_used(const void *p1, const void *p2)
+{
+	const struct disk_file *f1 = (const struct disk_file *)p1;
+	const struct disk_file *f2 = (const struct disk_file *)p2;
+	return f1->used < f2->used ? -1 : f1->used > f2->used;
+}
+
+// Remove the least recently used files over the budget, and the stale partial ones
+static void trim()
+{
+	DIR *d = opendir(dir);
+	if (d == 0)
+		return;
+	struct disk_file *files = 0;
+	int n = 0, size = 0;
+	size_t total = 0;
+	time_t now = time(0);
+	char path[PATH_MAX];
+	struct dirent *de;
+	while ((de = readdir(d)) != 0) {
+		size_t len = strlen(de->d_name);
+		struct stat st;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if (de->d_name[0] == '.') {
+			// Partial files are named .<name>.<pid>
+			if (strstr(de->d_name, DISK_SUFFIX ".") && lstat(path, &st) == 0
+			    && S_ISREG(st.st_mode) && now - st.st_mtime > DISK_STALE)
+				unlink(path);
+			continue;
+		}
+		if (len <= strlen(DISK_SUFFIX) || strcmp(de->d_name + len - strlen(DISK_SUFFIX), DISK_SUFFIX) != 0
+		    || lstat(path, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		if (n == size) {
+			size = size ? 2 * size : 64;
+			struct disk_file *f = (struct disk_file *)realloc(files, size * sizeof(*files));
+			if (f == 0)
+				break;
+			files = f;
+		}
+		files[n].used = st.st_mtime;
+		files[n].size = st.st_size;
+		files[n].name = strdup(de->d_name);
+		if (files[n].name == 0)
+			break;
+		total += st.st_size;
+		n++;
+	}
+	closedir(d);
+	qsort(files, n, sizeof(*files), cmp_used);
+	for (int i = 0; i < n; i++) {
+		if (total > budget) {
+			snprintf(path, sizeof(path), "%s/%s", dir, files[i].name);
+			if (unlink(path) == 0)
+				total -= files[i].size;
+			if (verbose)
+				fprintf(stderr, "Removed %s from the disk cache\n", path);
+		}
+		free(files[i].name);
+	}
+	free(files);
+}
+
+bool disk_open(const char *vdir, size_t vbudget)
+{
+	struct stat st;
+	if (mkdir(vdir, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Can't create disk cache %s\n", vdir);
+		return false;
+	}
+	if (stat(vdir, &st) != 0 || !S_ISDIR(st.st_mode) || access(vdir, R_OK | W_OK | X_OK) != 0) {
+		fprintf(stderr, "Can't use disk cache %s\n", vdir);
+		return false;
+	}
+	dir = strdup(vdir);
+	budget = vbudget;
+	if (dir == 0)
+		return false;
+	trim();
+	return true;
+}
+
+unsigned char *disk_find(const char *file, struct shared_raster &r, void *&map, size_t &mapLen)
+{
+	struct disk_header k, h;
+	char abs[PATH_MAX], name[PATH_MAX];
+	if (!file_key(file, k, abs, name, sizeof(name)))
+		return 0;
+	int fd = open_file(name, k, abs, h);
+	if (fd < 0)
+		return 0;
+	size_t len = DISK_HEADER + h.bytes;
+	void *m = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	// Modification time of the file is its last use
+	futimens(fd, NULL);
+	close(fd);
+	if (m == MAP_FAILED)
+		return 0;
+	r = h.r;
+	map = m;
+	mapLen = len;
+	return (unsigned char *)m + DISK_HEADER;
+}
+
+void disk_store(const char *file, const struct shared_raster &r, const unsigned char *buf)
+{
+	struct disk_header k, h;
+	char abs[PATH_MAX], name[PATH_MAX];
+	if (!file_key(file, k, abs, name, sizeof(name)))
+		return;
+	k.bytes = (uint64_t)r.bw * r.bh * r.nc * r.nb;
+	k.r = r;
+	if (k.bytes > budget)
+		return;
+	// Stored by another xiv meanwhile
+	int fd = open_file(name, k, abs, h);
+	if (fd >= 0) {
+		close(fd);
+		return;
+	}
+
+	// Written aside and renamed, so that other xiv never map a partial file
+	char tmp[PATH_MAX + 32];
+	const char *base = strrchr(name, '/') + 1;
+	snprintf(tmp, sizeof(tmp), "%s/.%s.%d", dir, base, (int)getpid());
+	unsigned char *header = (unsigned char *)calloc(DISK_HEADER, 1);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	bool ok = header != 0 && fd >= 0;
+	if (ok) {
+		memcpy(header, &k, sizeof(k));
+		memcpy(header + sizeof(k), abs, k.pathLen);
+		ok = write_all(fd, header, DISK_HEADER) && write_all(fd, buf, k.bytes);
+	}
+	if (fd >= 0 && close(fd) != 0)
+		ok = false;
+	free(header);
+	if (!ok || rename(tmp, name) != 0) {
+		unlink(tmp);
+		fprintf(stderr, "Can't store the raster of %s in %s\n", file, dir);
+		return;
+	}
+	if (verbose)
+		fprintf(stderr, "Stored the raster of %s in %s\n", file, name);
+	trim();
+}
@@ -0,0 +1,20 @@
+#ifndef _xiv_disk_h_
+#define _xiv_disk_h_
+
+#include "xiv_shared.h"
+
+// Decoded rasters kept in a directory across restarts of xiv, so that an image decoded once
+// is mapped instead of decoded again by the next xiv, even after a reboot.
+// A raster is stored in a file named after the path of its image, with a header telling the
+// size and modification time of the image, so that a changed image is decoded again.
+// The least recently used files are removed when the directory exceeds the budget given to
+// disk_open(). Writing and removing files is slow, disk_store() is meant for a background thread.
+
+// Use directory dir, created if needed, false if it can't be used
+bool disk_open(const char* dir, size_t budget);
+// Map the raster of file if it's stored, 0 if it isn't
+unsigned char* disk_find(const char* file, struct shared_raster& r, void*& map, size_t& mapLen);
+// Store buf, the raster of file, unless it's already stored, and trim the directory
+void disk_store(const char* file, const struct shared_raster& r, const unsigned char* buf);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef _xiv_pyramid_h_
+#define _xiv_pyramid_h_
+
+#include <stdint.h>
+
+// xiv pyramid file, written by xiv-prep and mapped by xiv.
+// Level l is the image reduced by 2^l (averaging 2x2 pixels), down to a single pixel.
+// Every level is cut in tiles of tw x th pixels of 3 samples of nb bytes in the byte order
+// of the writer, tiles on the right and bottom edges are padded.
+// The header is followed by the index of the tiles, level by level and row by row,
+// then by the tiles, raw or compressed with LZ4.
+
+#define PYRAMID_MAGIC "XIVPYR1"
+// Written as is, a reader with another byte order doesn't recognize it
+#define PYRAMID_ORDER 0x01020304
+
+enum
+  {
+    PYRAMID_RAW,
+    PYRAMID_LZ4
+  };
+
+struct pyramid_header
+{
+  char magic[8];
+  uint32_t order;
+  uint32_t w, h;        // Size of level 0
+  uint32_t tw, th;      // Size of tiles
+  uint32_t levels;
+  uint16_t nb;          // Bytes per sample, 1 or 2
+  uint16_t compression;
+  uint32_t max;         // Max sample value
+};
+
+// Location of a tile in the file.
+// A tile of a compressed pyramid is stored raw when LZ4 doesn't make it smaller.
+struct pyramid_tile
+{
+  uint64_t offset;
+  uint64_t len;
+};
+
+// Size of level l of a side of n pixels
+inline uint32_t pyramid_side(uint32_t n, int l)
+{
+  return (uint32_t)(((uint64_t)n + ((uint64_t)1 << l) - 1) >> l);
+}
+
+#endif
@@ -8,11 +8,29 @@
 #ifdef HAVE_LIBTIFF
 #include <tiffio.h>
 #endif
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#ifdef HAVE_LIBLZ4
+#include <lz4.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "xiv_pyramid.h"
 
 extern bool verbose;
+extern int loadThreads;
 
 // Swap bytes of an unsigned short
 inline unsigned short swap(unsigned short s)
@@ -32,6 +50,87 @@ inline int endian()
 	return *(unsigned char *)&s;	// 1 for x86 Little Endian LSB
 }
 
+// Swap the bytes of n 16 bits samples if sw is set, returns their max value.
+// Uses SSE2 when it is available: bytes are swapped by shifting and the unsigned max is the
+// signed one of the samples with their sign bit flipped.
+static unsigned short swap_max_range(unsigned short *p, size_t n, bool sw)
+{
+	unsigned short m = 0;
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i sign = _mm_set1_epi16((short)0x8000);
+	__m128i vm = sign;
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((__m128i *) (p + i));
+		if (sw) {
+			v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+			_mm_storeu_si128((__m128i *) (p + i), v);
+		}
+		vm = _mm_max_epi16(vm, _mm_xor_si128(v, sign));
+	}
+	unsigned short t[8];
+	_mm_storeu_si128((__m128i *) t, _mm_xor_si128(vm, sign));
+	for (int k = 0; k < 8; k++) {
+		if (t[k] > m)
+			m = t[k];
+	}
+#endif
+	for (; i < n; i++) {
+		if (sw)
+			p[i] = swap(p[i]);
+		if (p[i] > m)
+			m = p[i];
+	}
+	return m;
+}
+
+struct swap_max_part {
+	unsigned short *p;
+	size_t n;
+	bool sw;
+	unsigned short max;
+	pthread_t th;
+};
+
+static void *swap_max_thread(void *arg)
+{
+	struct swap_max_part *part = (struct swap_max_part *)arg;
+	part->max = swap_max_range(part->p, part->n, part->sw);
+	return 0;
+}
+
+// Swap the bytes of n 16 bits samples if sw is set and return their max value,
+// big rasters are split between loadThreads threads.
+static int swap_max(unsigned short *p, size_t n, bool sw)
+{
+	int nb = loadThreads > 1 && n >= (1 << 22) ? loadThreads : 1;
+	struct swap_max_part *parts = 0;
+	if (nb > 1)
+		parts = (struct swap_max_part *)calloc(nb, sizeof(struct swap_max_part));
+	if (parts == NULL)
+		return swap_max_range(p, n, sw);
+	for (int i = 0; i < nb; i++) {
+		size_t i0 = n * i / nb, i1 = n * (i + 1) / nb;
+		parts[i].p = p + i0;
+		parts[i].n = i1 - i0;
+		parts[i].sw = sw;
+		// Done by the calling thread if no thread can be created
+		if (i == 0 || pthread_create(&parts[i].th, NULL, swap_max_thread, parts + i) != 0) {
+			swap_max_thread(parts + i);
+			parts[i].n = 0;
+		}
+	}
+	int m = 0;
+	for (int i = 0; i < nb; i++) {
+		if (parts[i].n > 0)
+			pthread_join(parts[i].th, NULL);
+		if (parts[i].max > m)
+			m = parts[i].max;
+	}
+	free(parts);
+	return m;
+}
+
 // Read a line from a ppm file discarding comment and empty lines
 char *read_ppm_line(FILE * f, char *buf)
 {
@@ -43,31 +142,328 @@ char *read_ppm_line(FILE * f, char *buf)
 	return buf;
 }
 
-// Read a ppm image, returns 0 if not recognized.
-// Returns width, height, nb of bytes (1 or 2) and max value for 16 bits imagery.
-// Max value is used in case a 16 bits image has less significant bits (eg 12 or 14 for some camera).
-unsigned char *read_ppm(const char *sFile, int &iW, int &iH, int &nbBytes,
-			int &max)
+// Open an image file and tell its format from its first bytes, returns false if it can't be
+// opened or isn't a regular file.
+bool open_image_file(const char *name, struct image_file &f)
 {
-	FILE *f = fopen(sFile, "rb");
-	if (f == NULL)
+	f.name = name;
+	f.cancel = 0;
+	f.fd = open(name, O_RDONLY);
+	if (f.fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(f.fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(f.fd);
+		f.fd = -1;
+		return false;
+	}
+	f.size = st.st_size;
+	ssize_t n = pread(f.fd, f.head, sizeof(f.head), 0);
+	f.headLen = n > 0 ? n : 0;
+	const unsigned char *h = f.head;
+	f.format = IMAGE_OTHER;
+	if (f.headLen >= 8 && memcmp(h, PYRAMID_MAGIC, 8) == 0)
+		f.format = IMAGE_PYRAMID;
+	else if (f.headLen >= 2 && h[0] == 'P' && (h[1] == '6' || h[1] == '5'))
+		f.format = IMAGE_PPM;
+	else if (f.headLen >= 3 && h[0] == 0xff && h[1] == 0xd8 && h[2] == 0xff)
+		f.format = IMAGE_JPEG;
+	else if (f.headLen >= 8 && memcmp(h, "\x89PNG\r\n\x1a\n", 8) == 0)
+		f.format = IMAGE_PNG;
+	else if (f.headLen >= 4
+		 && ((h[0] == 'I' && h[1] == 'I' && (h[2] == 42 || h[2] == 43) && h[3] == 0)
+		     || (h[0] == 'M' && h[1] == 'M' && h[2] == 0 && (h[3] == 42 || h[3] == 43)))) {
+		// NEF files look like TIFF but are left to ImageMagick
+		size_t len = strlen(name);
+		if (len < 3 || strcasecmp(name + len - 3, "nef") != 0)
+			f.format = IMAGE_TIFF;
+	}
+	return true;
+}
+
+void close_image_file(struct image_file &f)
+{
+	if (f.fd >= 0)
+		close(f.fd);
+	f.fd = -1;
+}
+
+// Files read ahead by a thread while they are decoded, by chunks queued in a ring
+#define READ_AHEAD_MIN (16 << 20)
+#define READ_AHEAD_CHUNK (4 << 20)
+#define READ_AHEAD_CHUNKS 4
+
+struct read_ahead {
+	int fd;
+	unsigned char *chunk[READ_AHEAD_CHUNKS];
+	ssize_t len[READ_AHEAD_CHUNKS];
+	// Chunks first to first + count - 1 are read, off bytes of the first one were consumed
+	int first, count;
+	size_t off;
+	bool eof, quit;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t th;
+};
+
+// Read ahead thread, fills the ring until the end of the file
+static void *read_ahead_thread(void *arg)
+{
+	struct read_ahead *ra = (struct read_ahead *)arg;
+	size_t pos = 0;
+	pthread_mutex_lock(&ra->mutex);
+	while (!ra->quit && !ra->eof) {
+		if (ra->count == READ_AHEAD_CHUNKS) {
+			pthread_cond_wait(&ra->cond, &ra->mutex);
+			continue;
+		}
+		int k = (ra->first + ra->count) % READ_AHEAD_CHUNKS;
+		pthread_mutex_unlock(&ra->mutex);
+		// The kernel starts reading the next chunk while this one is read
+		posix_fadvise(ra->fd, pos + READ_AHEAD_CHUNK, READ_AHEAD_CHUNK, POSIX_FADV_WILLNEED);
+		ssize_t n = 0;
+		while (n < READ_AHEAD_CHUNK) {
+			ssize_t r = pread(ra->fd, ra->chunk[k] + n, READ_AHEAD_CHUNK - n, pos + n);
+			if (r <= 0)
+				break;
+			n += r;
+		}
+		pos += n;
+		pthread_mutex_lock(&ra->mutex);
+		ra->len[k] = n;
+		ra->count++;
+		ra->eof = n < READ_AHEAD_CHUNK;
+		pthread_cond_broadcast(&ra->cond);
+	}
+	pthread_mutex_unlock(&ra->mutex);
+	return 0;
+}
+
+static ssize_t read_ahead_read(void *cookie, char *buf, size_t size)
+{
+	struct read_ahead *ra = (struct read_ahead *)cookie;
+	pthread_mutex_lock(&ra->mutex);
+	while (ra->count == 0 && !ra->eof)
+		pthread_cond_wait(&ra->cond, &ra->mutex);
+	if (ra->count == 0) {
+		pthread_mutex_unlock(&ra->mutex);
 		return 0;
-	char sTmp[1024];
-	// P6
-	read_ppm_line(f, sTmp);
-	if (strstr(sTmp, "P6") != sTmp) {
-		fclose(f);
+	}
+	int k = ra->first;
+	pthread_mutex_unlock(&ra->mutex);
+	// The first chunk isn't written by the thread until it is consumed
+	size_t n = ra->len[k] - ra->off;
+	if (n > size)
+		n = size;
+	memcpy(buf, ra->chunk[k] + ra->off, n);
+	ra->off += n;
+	if (ra->off == (size_t)ra->len[k]) {
+		pthread_mutex_lock(&ra->mutex);
+		ra->off = 0;
+		ra->first = (ra->first + 1) % READ_AHEAD_CHUNKS;
+		ra->count--;
+		pthread_cond_broadcast(&ra->cond);
+		pthread_mutex_unlock(&ra->mutex);
+	}
+	return n;
+}
+
+static int read_ahead_close(void *cookie)
+{
+	struct read_ahead *ra = (struct read_ahead *)cookie;
+	pthread_mutex_lock(&ra->mutex);
+	ra->quit = true;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->mutex);
+	pthread_join(ra->th, NULL);
+	for (int i = 0; i < READ_AHEAD_CHUNKS; i++)
+		free(ra->chunk[i]);
+	pthread_mutex_destroy(&ra->mutex);
+	pthread_cond_destroy(&ra->cond);
+	close(ra->fd);
+	free(ra);
+	return 0;
+}
+
+// A stream of a big file read by a thread ahead of the decoder, so that reading the file
+// and decoding it overlap. Returns NULL if it can't be set up.
+static FILE *read_ahead_stream(int fd)
+{
+	struct read_ahead *ra = (struct read_ahead *)calloc(1, sizeof(struct read_ahead));
+	if (ra == NULL)
+		return NULL;
+	bool ok = true;
+	for (int i = 0; i < READ_AHEAD_CHUNKS; i++) {
+		ra->chunk[i] = (unsigned char *)malloc(READ_AHEAD_CHUNK);
+		ok = ok && ra->chunk[i] != NULL;
+	}
+	ra->fd = fd;
+	pthread_mutex_init(&ra->mutex, NULL);
+	pthread_cond_init(&ra->cond, NULL);
+	cookie_io_functions_t io = { read_ahead_read, NULL, NULL, read_ahead_close };
+	FILE *s = 0;
+	if (ok && pthread_create(&ra->th, NULL, read_ahead_thread, ra) == 0) {
+		s = fopencookie(ra, "rb", io);
+		if (s == NULL) {
+			ra->fd = -1;
+			read_ahead_close(ra);
+		}
+		return s;
+	}
+	for (int i = 0; i < READ_AHEAD_CHUNKS; i++)
+		free(ra->chunk[i]);
+	pthread_mutex_destroy(&ra->mutex);
+	pthread_cond_destroy(&ra->cond);
+	free(ra);
+	return NULL;
+}
+
+// A stream reading f from its start, closed by fclose().
+// Streams of readers going through the whole file (ahead set) are read ahead when it's big.
+static FILE *image_stream(const struct image_file &f, bool ahead)
+{
+	int fd = dup(f.fd);
+	if (fd < 0)
+		return NULL;
+	if (ahead && f.size >= READ_AHEAD_MIN) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		FILE *s = read_ahead_stream(fd);
+		if (s)
+			return s;
+	}
+	FILE *s = fdopen(fd, "rb");
+	if (s == NULL) {
+		close(fd);
+		return NULL;
+	}
+	if (fseek(s, 0, SEEK_SET) != 0) {
+		fclose(s);
+		return NULL;
+	}
+	return s;
+}
+
+// Read n bytes at offset off of f, from its first bytes when they are there
+static bool read_at(const struct image_file &f, size_t off, void *buf, size_t n)
+{
+	if (off + n <= f.headLen) {
+		memcpy(buf, f.head + off, n);
+		return true;
+	}
+	return pread(f.fd, buf, n, off) == (ssize_t) n;
+}
+
+inline unsigned int get16(const unsigned char *p, bool le)
+{
+	return le ? p[0] | p[1] << 8 : p[0] << 8 | p[1];
+}
+
+inline unsigned int get32(const unsigned char *p, bool le)
+{
+	return le ? p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24
+	    : (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Orientation tag of the first IFD of the tiff structure of len bytes at offset base of f,
+// 0 if there is none
+static int tiff_orientation(const struct image_file &f, size_t base, size_t len)
+{
+	unsigned char h[8];
+	if (len < 8 || !read_at(f, base, h, 8)
+	    || !((h[0] == 'I' && h[1] == 'I') || (h[0] == 'M' && h[1] == 'M')))
+		return 0;
+	bool le = h[0] == 'I';
+	size_t ifd = get32(h + 4, le);
+	if (ifd + 2 > len || !read_at(f, base + ifd, h, 2))
 		return 0;
+	size_t count = get16(h, le);
+	if (ifd + 2 + 12 * count > len)
+		count = (len - ifd - 2) / 12;
+	unsigned char *e = (unsigned char *)malloc(12 * count + 1);
+	int o = 0;
+	if (e && read_at(f, base + ifd + 2, e, 12 * count)) {
+		for (size_t i = 0; i < count; i++) {
+			// Orientation is a short
+			if (get16(e + 12 * i, le) == 0x0112 && get16(e + 12 * i + 2, le) == 3)
+				o = get16(e + 12 * i + 8, le);
+		}
 	}
-	// iW, iH
-	read_ppm_line(f, sTmp);
-	sscanf(sTmp, "%d %d", &iW, &iH);
-	if (iW < 0 || iW > 65536 || iH < 0 || iH > 65536) {
-		fclose(f);
+	free(e);
+	return o;
+}
+
+// Read the EXIF orientation of a jpeg image without decoding it:
+// 0 is none, 1 is 90 counter clockwise (left - bottom), 2 is 180 (bottom - right),
+// 3 is 90 clockwise (right - top). Mirrored orientations are ignored.
+int read_orientation(const struct image_file &f)
+{
+	int o = 0;
+	if (f.format == IMAGE_JPEG) {
+		// Walk the segments up to the Exif one, which comes first in practice
+		size_t pos = 2;
+		unsigned char m[6];
+		while (pos + 4 <= f.size && read_at(f, pos, m, 4) && m[0] == 0xff) {
+			if (m[1] == 0xff) {
+				pos++;
+				continue;
+			}
+			// Start of scan or end of image
+			if (m[1] == 0xda || m[1] == 0xd9)
+				break;
+			size_t l = m[2] << 8 | m[3];
+			if (m[1] == 0xe1 && l >= 16 && read_at(f, pos + 4, m, 6)
+			    && memcmp(m, "Exif\0\0", 6) == 0) {
+				o = tiff_orientation(f, pos + 10, l - 8);
+				break;
+			}
+			pos += 2 + l;
+		}
+	}
+	switch (o) {
+	case 8:
+		return 1;
+	case 3:
+		return 2;
+	case 6:
+		return 3;
+	default:
+		return 0;
+	}
+}
+
+// Expand a raster of n gray samples of nb bytes to RGB, returns the new raster or 0 if out of memory
+static unsigned char *gray_to_rgb(unsigned char *buf, size_t n, int nb)
+{
+	unsigned char *rgb = (unsigned char *)realloc(buf, n * 3 * nb);
+	if (rgb == NULL) {
+		free(buf);
 		return 0;
 	}
+	// From the end so that samples aren't overwritten before being copied
+	for (size_t i = n; i-- > 0;) {
+		for (int c = 0; c < 3; c++)
+			memcpy(rgb + (i * 3 + c) * nb, rgb + i * nb, nb);
+	}
+	return rgb;
+}
+
+// Read a ppm (P6) or pgm (P5) image from a stream, returns 0 if not recognized or cancelled.
+// Gray images are kept with 1 sample per pixel if nc is given, see read_ppm().
+static unsigned char *read_ppm_stream(FILE * f, int &iW, int &iH,
+				      int &nbBytes, int &max, volatile bool *cancel, int *nc)
+{
+	char sTmp[1024];
+	// P6 or P5
+	if (!read_ppm_line(f, sTmp) || (strstr(sTmp, "P6") != sTmp && strstr(sTmp, "P5") != sTmp))
+		return 0;
+	int c = sTmp[1] == '5' ? 1 : 3;
+	// iW, iH
+	if (!read_ppm_line(f, sTmp) || sscanf(sTmp, "%d %d", &iW, &iH) != 2
+	    || iW < 0 || iW > 65536 || iH < 0 || iH > 65536)
+		return 0;
 	// 255
-	read_ppm_line(f, sTmp);
+	if (!read_ppm_line(f, sTmp))
+		return 0;
 	if (strstr(sTmp, "255") == sTmp) {
 		nbBytes = 1;
 		max = 255;
@@ -76,54 +472,868 @@ unsigned char *read_ppm(const char *sFile, int &iW, int &iH, int &nbBytes,
 		max = 0;	// Will be computed later
 	} else
 		return 0;
-	unsigned char *buf = (unsigned char *)malloc(iW * iH * 3 * nbBytes);
+	unsigned char *buf = (unsigned char *)malloc((size_t)iW * iH * c * nbBytes);
 	if (buf == NULL)
 		return 0;
 
-	if (!fread(buf, iW * iH, 3 * nbBytes, f))
-        return 0;
-	// If image is 16 bit wide, compute max value in case there a less significant bytes.
-	if (nbBytes == 2) {
-		unsigned short *p = (unsigned short *)buf;
-		for (int i = 0; i < iW * iH * 3; i++) {
-			if (endian())
-				*p = swap(*p);
-			if (*p > max)
-				max = *p;
-			p++;
+	// Read by bands, 16 bits samples are swapped and scanned while the next band is read
+	size_t len = (size_t)iW * iH * c * nbBytes;
+	size_t band = 16 << 20;
+	size_t done = 0;
+	while (done < len) {
+		if (cancel && *cancel) {
+			free(buf);
+			return 0;
+		}
+		size_t n = fread(buf + done, 1, len - done < band ? len - done : band, f);
+		if (n == 0)
+			break;
+		// If image is 16 bit wide, compute max value in case there a less significant bytes.
+		if (nbBytes == 2) {
+			int m = swap_max((unsigned short *)(buf + done), n / 2, endian());
+			if (m > max)
+				max = m;
+		}
+		done += n;
+	}
+	if (done == 0) {
+		free(buf);
+		return 0;
+	}
+	if (c == 1 && nc == 0)
+		return gray_to_rgb(buf, (size_t)iW * iH, nbBytes);
+	if (nc)
+		*nc = c;
+	return buf;
+}
+
+// Read a ppm or pgm image, returns 0 if not recognized.
+// Returns width, height, nb of bytes (1 or 2) and max value for 16 bits imagery.
+// Max value is used in case a 16 bits image has less significant bits (eg 12 or 14 for some camera).
+// If nc is given, it's set to the samples per pixel: gray images are kept as 1 sample
+// per pixel, otherwise they're expanded to RGB.
+unsigned char *read_ppm(const struct image_file &file, int &iW, int &iH,
+			int &nbBytes, int &max, int *nc)
+{
+	FILE *f = image_stream(file, true);
+	if (f == NULL)
+		return 0;
+	unsigned char *buf = read_ppm_stream(f, iW, iH, nbBytes, max, file.cancel, nc);
+	fclose(f);
+	return buf;
+}
+
+// Convert an image with ImageMagick, returns 0 if it fails.
+// convert writes a ppm to a pipe which is read as it comes, without temporary file.
+unsigned char *read_converted(const char *sFile, int &iW, int &iH,
+			      int &nbBytes, int &max, int *nc)
+{
+	// Not inherited by the convert of another thread, which would keep the pipe open.
+	// dup2() clears the flag of the output of convert.
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) != 0)
+		return 0;
+	pid_t pid = fork();
+	if (pid == 0) {
+		dup2(fds[1], 1);
+		close(fds[0]);
+		close(fds[1]);
+		execlp("convert", "convert", sFile, "-quiet", "ppm:-", (char *)NULL);
+		_exit(127);
+	}
+	close(fds[1]);
+	if (pid < 0) {
+		close(fds[0]);
+		return 0;
+	}
+	FILE *f = fdopen(fds[0], "rb");
+	unsigned char *buf = 0;
+	if (f) {
+		buf = read_ppm_stream(f, iW, iH, nbBytes, max, 0, nc);
+		fclose(f);
+	} else
+		close(fds[0]);
+	int status;
+	waitpid(pid, &status, 0);
+	return buf;
+}
+
+#ifdef HAVE_LIBPNG
+// Errors end the decoding through setjmp
+static void png_error_handler(png_structp png, png_const_charp msg)
+{
+	if (verbose)
+		fprintf(stderr, "png: %s\n", msg);
+	longjmp(png_jmpbuf(png), 1);
+}
+
+static void png_warning_handler(png_structp png, png_const_charp msg)
+{
+}
+#endif
+
+// Read a png image, returns 0 if not recognized.
+// Rows are decoded straight into the returned buffer, 16 bits images stay 16 bits.
+// Returns width, height, nb of bytes (1 or 2) and max value for 16 bits imagery.
+// Gray images are kept as 1 sample per pixel if nc is given, see read_ppm().
+unsigned char *read_png(const struct image_file &file, int &iW, int &iH,
+			int &nbBytes, int &max, int *nc)
+{
+#ifdef HAVE_LIBPNG
+	FILE *f = image_stream(file, true);
+	if (f == NULL)
+		return 0;
+	png_byte sig[8];
+	if (fread(sig, 1, 8, f) != 8 || png_sig_cmp(sig, 0, 8) != 0) {
+		fclose(f);
+		return 0;
+	}
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
+						 png_error_handler,
+						 png_warning_handler);
+	png_infop info = png ? png_create_info_struct(png) : NULL;
+	if (info == NULL) {
+		png_destroy_read_struct(&png, NULL, NULL);
+		fclose(f);
+		return 0;
+	}
+	// volatile as they are changed between setjmp and longjmp
+	unsigned char *volatile buf = 0;
+	png_bytep *volatile rows = 0;
+	if (setjmp(png_jmpbuf(png))) {
+		free(buf);
+		free(rows);
+		png_destroy_read_struct(&png, &info, NULL);
+		fclose(f);
+		return 0;
+	}
+	png_init_io(png, f);
+	png_set_sig_bytes(png, 8);
+	png_read_info(png, info);
+	iW = png_get_image_width(png, info);
+	iH = png_get_image_height(png, info);
+	int depth = png_get_bit_depth(png, info);
+	int type = png_get_color_type(png, info);
+	// Everything is read as RGB or gray of 8 or 16 bits
+	png_set_expand(png);
+	png_set_strip_alpha(png);
+	bool gray = type == PNG_COLOR_TYPE_GRAY || type == PNG_COLOR_TYPE_GRAY_ALPHA;
+	if (gray && nc == 0)
+		png_set_gray_to_rgb(png);
+	int c = gray && nc ? 1 : 3;
+	// Samples are big endian
+	if (depth == 16 && endian())
+		png_set_swap(png);
+	int passes = png_set_interlace_handling(png);
+	png_read_update_info(png, info);
+	nbBytes = depth == 16 ? 2 : 1;
+	if (png_get_rowbytes(png, info) != (size_t)iW * c * nbBytes)
+		png_error(png, "unexpected row size");
+	buf = (unsigned char *)malloc((size_t)iW * iH * c * nbBytes);
+	rows = (png_bytep *) malloc(iH * sizeof(png_bytep));
+	if (buf == NULL || rows == NULL)
+		png_error(png, "not enough memory");
+	for (int i = 0; i < iH; i++)
+		rows[i] = buf + (size_t)i * iW * c * nbBytes;
+	for (int pass = 0; pass < passes; pass++) {
+		for (int i = 0; i < iH; i++) {
+			if (cancelled(file))
+				png_error(png, "cancelled");
+			png_read_row(png, rows[i], NULL);
 		}
 	}
+	png_read_end(png, NULL);
+	png_destroy_read_struct(&png, &info, NULL);
+	free(rows);
 	fclose(f);
+	if (nbBytes == 2)	// Max value in case there are less significant bits
+		max = swap_max((unsigned short *)buf, (size_t)iW * iH * c, false);
+	else
+		max = 255;
+	if (nc)
+		*nc = c;
+	if (verbose)
+		fprintf(stderr, "read_png %s w %d h %d depth %d type %d\n", file.name, iW, iH, depth, type);
 	return buf;
+#else
+	return 0;
+#endif
+}
+
+// Tiles of a 16 bits ppm are bands of rows read from the file
+// Tiles sampled by sample_max()
+#define MAX_SAMPLES 8
+
+// Max value of a 16 bits image read by tiles of tw x th pixels from src, sampled in MAX_SAMPLES
+// tiles spread over the image so that it's opened quickly. The max of the whole image would
+// only change the brightness if one of its bits isn't used by the samples, see nbits in xiv.cpp.
+// Called before the source is given to Tiles, which then reads it from its worker threads.
+static int sample_max(TileSource *src, int iW, int iH, int tw, int th)
+{
+	size_t nx = (iW + tw - 1) / tw, n = nx * ((iH + th - 1) / th);
+	size_t samples = n < MAX_SAMPLES ? n : MAX_SAMPLES;
+	size_t len = (size_t)tw * th * 3;
+	// Edge tiles only fill a part of it
+	unsigned short *buf = (unsigned short *)calloc(len, 2);
+	int m = 0;
+	for (size_t i = 0; buf && i < samples; i++) {
+		size_t k = (2 * i + 1) * n / (2 * samples);
+		if (src->read(0, 0, k % nx, k / nx, (unsigned char *)buf)) {
+			int v = swap_max(buf, len, false);
+			if (v > m)
+				m = v;
+		}
+	}
+	free(buf);
+	return m > 0 ? m : 65535;
+}
+
+class PpmTiles:public TileSource {
+ public:
+	PpmTiles(int vfd, size_t voffset, int vw, int vh,
+		 int vth):fd(vfd), offset(voffset), w(vw), h(vh), th(vth) {
+	}
+	~PpmTiles() {
+		close(fd);
+	}
+	bool read(int worker, int level, int tx, int ty, unsigned char *out) {
+		int rows = (ty + 1) * th < h ? th : h - ty * th;
+		size_t len = (size_t)w * rows * 6;
+		size_t pos = offset + (size_t)w * ty * th * 6;
+		for (size_t done = 0; done < len;) {
+			ssize_t r = pread(fd, out + done, len - done, pos + done);
+			if (r <= 0)
+				return false;
+			done += r;
+		}
+		// Samples are big endian
+		if (endian())
+			swap_max_range((unsigned short *)out, len / 2, true);
+		return true;
+	}
+
+	int fd;
+	size_t offset;
+	int w, h, th;
+};
+
+// Open a 16 bits binary ppm image bigger than minBytes as tiles read when drawn, returns 0
+// if not recognized or smaller. Max value is sampled, see sample_max().
+Tiles *open_ppm_tiles(const struct image_file &file, int &iW, int &iH,
+		      int &max, size_t minBytes)
+{
+	FILE *f = image_stream(file, false);
+	if (f == NULL)
+		return 0;
+	char sTmp[1024];
+	if (!read_ppm_line(f, sTmp) || strstr(sTmp, "P6") != sTmp
+	    || !read_ppm_line(f, sTmp) || sscanf(sTmp, "%d %d", &iW, &iH) != 2
+	    || iW <= 0 || iW > 65536 || iH <= 0 || iH > 65536
+	    || !read_ppm_line(f, sTmp) || strstr(sTmp, "65535") != sTmp
+	    || (size_t)iW * iH * 6 < minBytes) {
+		fclose(f);
+		return 0;
+	}
+	long offset = ftell(f);
+	int fd = dup(fileno(f));
+	fclose(f);
+	if (offset < 0 || fd < 0) {
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+	// Bands of about 4MB
+	int th = 1 + (4 << 20) / ((size_t)iW * 6);
+	PpmTiles *src = new PpmTiles(fd, offset, iW, iH, th);
+	max = sample_max(src, iW, iH, iW, th);
+	if (verbose)
+		fprintf(stderr, "open_ppm_tiles %s w %d h %d max %d\n", file.name, iW, iH, max);
+	int n = loadThreads > 0 ? loadThreads : 1;
+	return new Tiles(src, iW, iH, iW, th, 2, 1, n);
+}
+
+// Map len bytes of raster data starting at offset in file.
+// Returns a pointer to the raster inside the mapping, 0 if the file is too short or can't be mapped.
+static unsigned char *map_raster(const struct image_file &file, size_t offset,
+				 size_t len, void *&map, size_t &mapLen)
+{
+	if (file.size < offset + len)
+		return 0;
+	mapLen = file.size;
+	map = mmap(NULL, mapLen, PROT_READ, MAP_SHARED, file.fd, 0);
+	if (map == MAP_FAILED) {
+		map = 0;
+		return 0;
+	}
+	// If the raster fits comfortably in RAM, start reading it in the background.
+	// Otherwise only fault in what the view actually touches.
+	size_t ram = (size_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+	madvise(map, mapLen, mapLen < ram / 2 ? MADV_WILLNEED : MADV_RANDOM);
+	return (unsigned char *)map + offset;
+}
+
+// Map an 8 bits binary ppm image without copying it, returns 0 if not recognized.
+// The raster is only read when pages are touched.
+// Pgm images are only mapped if nc is given, see read_ppm().
+unsigned char *map_ppm(const struct image_file &file, int &iW, int &iH,
+		       void *&map, size_t &mapLen, int *nc)
+{
+	FILE *f = image_stream(file, false);
+	if (f == NULL)
+		return 0;
+	char sTmp[1024];
+	bool ok = read_ppm_line(f, sTmp) != 0;
+	bool pgm = ok && nc && strstr(sTmp, "P5") == sTmp;
+	int c = pgm ? 1 : 3;
+	if (!ok || (!pgm && strstr(sTmp, "P6") != sTmp)
+	    || !read_ppm_line(f, sTmp) || sscanf(sTmp, "%d %d", &iW, &iH) != 2
+	    || iW <= 0 || iW > 65536 || iH <= 0 || iH > 65536
+	    || !read_ppm_line(f, sTmp) || strstr(sTmp, "255") != sTmp) {
+		fclose(f);
+		return 0;
+	}
+	long offset = ftell(f);
+	fclose(f);
+	if (offset < 0)
+		return 0;
+	unsigned char *buf = map_raster(file, offset, (size_t)iW * iH * c, map, mapLen);
+	if (buf && nc)
+		*nc = c;
+	return buf;
+}
+
+// Tiles of an xiv pyramid, copied or uncompressed from the mapped file
+class PyramidTiles:public TileSource {
+ public:
+	PyramidTiles(void *vmap, size_t vlen):map(vmap), len(vlen) {
+		hdr = (const struct pyramid_header *)map;
+		index = (const struct pyramid_tile *)(hdr + 1);
+		tileBytes = (size_t)hdr->tw * hdr->th * 3 * hdr->nb;
+		base = (size_t *)malloc((hdr->levels + 1) * sizeof(size_t));
+		nxl = (uint32_t *)malloc(hdr->levels * sizeof(uint32_t));
+		if (base && nxl) {
+			base[0] = 0;
+			for (uint32_t l = 0; l < hdr->levels; l++) {
+				nxl[l] = (pyramid_side(hdr->w, l) + hdr->tw - 1) / hdr->tw;
+				base[l + 1] = base[l] + (size_t)nxl[l]
+				    * ((pyramid_side(hdr->h, l) + hdr->th - 1) / hdr->th);
+			}
+		}
+	}
+	~PyramidTiles() {
+		free(base);
+		free(nxl);
+		munmap(map, len);
+	}
+	bool read(int worker, int level, int tx, int ty, unsigned char *out);
+	bool overview(int ovs, int ow, int oh, unsigned char *out);
+
+	void *map;
+	size_t len;
+	const struct pyramid_header *hdr;
+	const struct pyramid_tile *index;
+	size_t tileBytes;
+	size_t *base;
+	uint32_t *nxl;
+};
+
+bool PyramidTiles::read(int worker, int level, int tx, int ty,
+			unsigned char *out)
+{
+	if (base == NULL || nxl == NULL)
+		return false;
+	const struct pyramid_tile *t = index + base[level] + (size_t)ty * nxl[level] + tx;
+	if (t->offset > len || t->len > len - t->offset)
+		return false;
+	const char *p = (const char *)map + t->offset;
+	if (t->len == tileBytes) {
+		memcpy(out, p, tileBytes);
+		return true;
+	}
+#ifdef HAVE_LIBLZ4
+	if (hdr->compression == PYRAMID_LZ4)
+		return LZ4_decompress_safe(p, (char *)out, (int)t->len,
+					   (int)tileBytes) == (int)tileBytes;
+#endif
+	return false;
+}
+
+// The overview is the level reduced by ovs, assembled from its tiles
+bool PyramidTiles::overview(int ovs, int ow, int oh, unsigned char *out)
+{
+	int l = 0;
+	while ((1 << l) < ovs)
+		l++;
+	if ((uint32_t)l >= hdr->levels || base == NULL || nxl == NULL
+	    || pyramid_side(hdr->w, l) != (uint32_t)ow
+	    || pyramid_side(hdr->h, l) != (uint32_t)oh)
+		return false;
+	unsigned char *buf = (unsigned char *)malloc(tileBytes);
+	if (buf == NULL)
+		return false;
+	size_t pix = (size_t)3 * hdr->nb;
+	int tw = hdr->tw, th = hdr->th;
+	for (int ty = 0; ty * th < oh; ty++) {
+		for (int tx = 0; tx * tw < ow; tx++) {
+			if (!read(0, l, tx, ty, buf)) {
+				free(buf);
+				return false;
+			}
+			int rows = oh - ty * th < th ? oh - ty * th : th;
+			int cols = ow - tx * tw < tw ? ow - tx * tw : tw;
+			for (int i = 0; i < rows; i++)
+				memcpy(out + pix * ((size_t)(ty * th + i) * ow + tx * tw),
+				       buf + pix * i * tw, pix * cols);
+		}
+	}
+	free(buf);
+	return true;
+}
+
+// Open an xiv pyramid, returns 0 if not recognized.
+// The file is mapped, tiles are copied or uncompressed from the mapping when drawn.
+Tiles *open_pyramid_tiles(const struct image_file &file, int &iW, int &iH,
+			  int &nbBytes, int &max)
+{
+	void *map = 0;
+	size_t mapLen = 0;
+	const struct pyramid_header *hdr = (const struct pyramid_header *)
+	    map_raster(file, 0, sizeof(struct pyramid_header), map, mapLen);
+	if (hdr == 0)
+		return 0;
+	bool ok = memcmp(hdr->magic, PYRAMID_MAGIC, sizeof(hdr->magic)) == 0
+	    && hdr->order == PYRAMID_ORDER && hdr->w > 0 && hdr->h > 0
+	    && hdr->w < (1u << 31) && hdr->h < (1u << 31)
+	    && (hdr->nb == 1 || hdr->nb == 2) && hdr->max > 0
+	    && hdr->tw > 0 && hdr->th > 0
+	    && (uint64_t)hdr->tw * hdr->th * 3 * hdr->nb <= (64 << 20)
+	    && hdr->levels > 0 && hdr->levels <= 32;
+#ifndef HAVE_LIBLZ4
+	if (ok && hdr->compression == PYRAMID_LZ4) {
+		fprintf(stderr, "%s is compressed with LZ4 which isn't available\n", file.name);
+		ok = false;
+	}
+#endif
+	if (ok) {
+		// Whole index must be in the file
+		uint64_t n = 0;
+		for (uint32_t l = 0; l < hdr->levels; l++)
+			n += (uint64_t)((pyramid_side(hdr->w, l) + hdr->tw - 1) / hdr->tw)
+			    * ((pyramid_side(hdr->h, l) + hdr->th - 1) / hdr->th);
+		ok = sizeof(struct pyramid_header) + n * sizeof(struct pyramid_tile) <= mapLen;
+	}
+	if (!ok) {
+		munmap(map, mapLen);
+		return 0;
+	}
+	iW = hdr->w;
+	iH = hdr->h;
+	nbBytes = hdr->nb;
+	max = hdr->max;
+	if (verbose)
+		fprintf(stderr, "open_pyramid_tiles %s w %d h %d nb %d levels %d tile %d %d%s\n",
+			file.name, iW, iH, nbBytes, hdr->levels, hdr->tw, hdr->th,
+			hdr->compression == PYRAMID_LZ4 ? " lz4" : "");
+	int n = loadThreads > 0 ? loadThreads : 1;
+	return new Tiles(new PyramidTiles(map, mapLen), iW, iH, hdr->tw, hdr->th,
+			 nbBytes, hdr->levels, n);
 }
 
 #ifdef HAVE_LIBJPEG
-jmp_buf env;
+// Error manager of one decompression, several may run at the same time
+struct jpeg_error {
+	struct jpeg_error_mgr pub;
+	jmp_buf env;
+};
 
 void error_handler(j_common_ptr cinfo)
 {
 	// Does nothing, it's just to prevent libjpeg from exiting
-	longjmp(env, 1);
+	longjmp(((struct jpeg_error *)cinfo->err)->env, 1);
 }
+
+#ifdef HAVE_JPEG_MEM_SRC
+// A horizontal band of a jpeg image starting and ending on restart markers.
+// It is decoded as a standalone image by its own thread.
+struct jpeg_band {
+	const unsigned char *hdr;	// Markers of the image up to the end of SOS
+	size_t hdrLen;
+	size_t sofHeight;	// Offset of the image height in hdr
+	const unsigned char *data;	// Entropy coded data of the band
+	size_t len;
+	int height;		// Rows of the image in the band
+	int scale, x, w;	// Reduction and decoded columns
+	int skip, rows;		// Output rows to skip and to decode
+	unsigned char *out;
+	volatile bool *cancel;	// Stops the decoding between rows, see image_file
+	pthread_t th;
+	bool ok;
+};
+
+void *decode_jpeg_band(void *arg)
+{
+	struct jpeg_band *b = (struct jpeg_band *)arg;
+	size_t len = b->hdrLen + b->len + 2;
+	unsigned char *s = (unsigned char *)malloc(len);
+	if (s == NULL)
+		return 0;
+	memcpy(s, b->hdr, b->hdrLen);
+	s[b->sofHeight] = b->height >> 8;
+	s[b->sofHeight + 1] = b->height & 0xff;
+	unsigned char *d = s + b->hdrLen;
+	memcpy(d, b->data, b->len);
+	// Restart markers must count from RST0 in the band
+	int n = 0;
+	for (unsigned char *p = d;
+	     (p = (unsigned char *)memchr(p, 0xff, d + b->len - 1 - p)) != NULL;
+	     p++) {
+		if (p[1] >= 0xd0 && p[1] <= 0xd7)
+			p[1] = 0xd0 + (n++ & 7);
+	}
+	d[b->len] = 0xff;
+	d[b->len + 1] = 0xd9;
+
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error jerr;
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = error_handler;
+	if (setjmp(jerr.env)) {
+		jpeg_destroy_decompress(&cinfo);
+		free(s);
+		return 0;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, s, len);
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = b->scale;
+	cinfo.out_color_space = JCS_RGB;
+	jpeg_start_decompress(&cinfo);
+#ifdef HAVE_JPEG_CROP_SCANLINE
+	if ((int)cinfo.output_width > b->w) {
+		JDIMENSION xo = b->x, wo = b->w;
+		jpeg_crop_scanline(&cinfo, &xo, &wo);
+	}
+#endif
+#ifdef HAVE_JPEG_SKIP_SCANLINES
+	if (b->skip > 0)
+		jpeg_skip_scanlines(&cinfo, b->skip);
+#endif
+	// Without jpeg_skip_scanlines, skipped rows are decoded in the first output row
+	bool ok = true;
+	while (cinfo.output_scanline < (JDIMENSION) (b->skip + b->rows)) {
+		if (b->cancel && *b->cancel) {
+			ok = false;
+			break;
+		}
+		int i = (int)cinfo.output_scanline - b->skip;
+		unsigned char *row = b->out + (size_t)(i > 0 ? i : 0) * 3 * b->w;
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+	if (cinfo.output_scanline < cinfo.output_height)
+		jpeg_abort_decompress(&cinfo);
+	else
+		jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	free(s);
+	b->ok = ok;
+	return 0;
+}
+
+// Restart markers of a jpeg image which start a row of MCUs.
+// The image can be decoded by bands of steps between them, see read_jpeg_bands().
+struct jpeg_index {
+	unsigned char *map;	// The file
+	size_t len;
+	size_t sos;		// End of the markers preceding the entropy coded data
+	size_t sofHeight;	// Offset of the image height
+	int stepH;		// Rows of the image in a step
+	int nbSteps;
+	bool context;		// Chroma is vertically subsampled, bands need a step above and below
+	size_t *start;		// Start of the data of each step, then 2 bytes past the end of the scan
+};
+
+// Rows of the image between two restart markers starting a row of MCUs, 0 if there are none
+static int jpeg_step(j_decompress_ptr cinfo, int &mcusPerStep)
+{
+	int ri = cinfo->restart_interval;
+	if (ri == 0 || cinfo->progressive_mode)
+		return 0;
+	// Size of an MCU, a single component scan has one block per MCU
+	int mcuW = DCTSIZE, mcuH = DCTSIZE;
+	if (cinfo->comps_in_scan > 1) {
+		mcuW *= cinfo->max_h_samp_factor;
+		mcuH *= cinfo->max_v_samp_factor;
+	} else if (cinfo->num_components > 1 || cinfo->max_h_samp_factor > 1
+		   || cinfo->max_v_samp_factor > 1)
+		return 0;
+	int mcusPerRow = (cinfo->image_width + mcuW - 1) / mcuW;
+	// Bands can start every step rows of MCUs
+	int a = ri, b = mcusPerRow;
+	while (b != 0) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	int step = ri / a;
+	mcusPerStep = step * mcusPerRow;
+	return step * mcuH;
+}
+
+static void free_index(struct jpeg_index &idx)
+{
+	if (idx.map)
+		munmap(idx.map, idx.len);
+	free(idx.start);
+	idx.map = 0;
+	idx.start = 0;
+}
+
+// Index the image read by cinfo up to the step following step last, returns false if it
+// can't be split in bands.
+static bool index_jpeg(const struct image_file &file, j_decompress_ptr cinfo,
+		       int last, struct jpeg_index &idx)
+{
+	memset(&idx, 0, sizeof(idx));
+	int mcusPerStep;
+	idx.stepH = jpeg_step(cinfo, mcusPerStep);
+	if (idx.stepH == 0)
+		return false;
+	idx.nbSteps = (cinfo->image_height + idx.stepH - 1) / idx.stepH;
+	idx.context = cinfo->max_v_samp_factor > 1;
+	if (last < idx.nbSteps)
+		last++;
+	else
+		last = idx.nbSteps;
+
+	if (file.size > 4) {
+		idx.len = file.size;
+		idx.map = (unsigned char *)mmap(NULL, idx.len, PROT_READ, MAP_SHARED, file.fd, 0);
+		if (idx.map == MAP_FAILED)
+			idx.map = 0;
+	}
+	if (idx.map == 0)
+		return false;
+	unsigned char *map = idx.map;
+	size_t len = idx.len;
+
+	// Find the frame height and the start of the entropy coded data
+	for (size_t i = 2; i + 4 <= len && idx.sos == 0 && map[i] == 0xff;) {
+		int m = map[i + 1];
+		if (m == 0xff) {
+			i++;
+			continue;
+		}
+		size_t l = (map[i + 2] << 8) | map[i + 3];
+		if (m >= 0xc0 && m <= 0xcf && m != 0xc4 && m != 0xc8 && m != 0xcc)
+			idx.sofHeight = i + 5;
+		else if (m == 0xda)
+			idx.sos = i + 2 + l;
+		i += 2 + l;
+	}
+	idx.start = (size_t *)malloc((idx.nbSteps + 1) * sizeof(size_t));
+	bool ok = idx.sofHeight != 0 && idx.sos != 0 && idx.sos < len
+	    && idx.start != NULL;
+	if (ok) {
+		madvise(map, len, MADV_SEQUENTIAL);
+		idx.start[0] = idx.sos;
+		int nbRst = 0, k = 1;
+		const unsigned char *p = map + idx.sos;
+		const unsigned char *end = map + len - 1;
+		while (k <= last && p < end
+		       && (p = (const unsigned char *)memchr(p, 0xff, end - p)) != NULL) {
+			int m = p[1];
+			if (m >= 0xd0 && m <= 0xd7) {
+				// The next restart interval starts a step
+				if ((long)(++nbRst) * cinfo->restart_interval % mcusPerStep == 0
+				    && k < idx.nbSteps)
+					idx.start[k++] = p + 2 - map;
+				p += 2;
+			} else if (m == 0x00 || m == 0xff)
+				p++;
+			else {
+				// End of the scan
+				if (k == idx.nbSteps)
+					idx.start[k++] = p + 2 - map;
+				break;
+			}
+		}
+		ok = k > last;
+		madvise(map, len, MADV_NORMAL);
+	}
+	if (!ok)
+		free_index(idx);
+	return ok;
+}
+
+// Set b to decode output rows [o0,o1[ of steps [b0,b1[ reduced by scale, columns [x,x+w[
+static void init_band(struct jpeg_band *b, struct jpeg_index &idx, int iH,
+		      int b0, int b1, int scale, int x, int w, int o0, int o1,
+		      unsigned char *out)
+{
+	// One more step above and below for chroma upsampling
+	int c0 = b0 > 0 && idx.context ? b0 - 1 : b0;
+	int c1 = b1 < idx.nbSteps && idx.context ? b1 + 1 : b1;
+	int r0 = c0 * idx.stepH;
+	int r1 = c1 * idx.stepH < iH ? c1 * idx.stepH : iH;
+	b->hdr = idx.map;
+	b->hdrLen = idx.sos;
+	b->sofHeight = idx.sofHeight;
+	b->data = idx.map + idx.start[c0];
+	// The end of a step is 2 bytes before the start of the next one
+	b->len = idx.start[c1] - 2 - idx.start[c0];
+	b->height = r1 - r0;
+	b->scale = scale;
+	b->x = x;
+	b->w = w;
+	b->skip = o0 - r0 / scale;
+	b->rows = o1 - o0;
+	b->out = out;
+	b->cancel = 0;
+	b->ok = false;
+}
+
+// Decode rows [y,y+h[ and columns [x,x+w[ of the jpeg image being read by cinfo into buf using
+// several threads, returns false if the image can't be split.
+// Bands are delimited by restart markers falling at the start of a row of MCUs, so only images
+// written with restart intervals (e.g. cjpeg -restart 1) are decoded in parallel.
+static bool read_jpeg_bands(const struct image_file &file, j_decompress_ptr cinfo,
+			    int scale, int x, int y, int w, int h,
+			    unsigned char *buf)
+{
+	int mcusPerStep;
+	int stepH = jpeg_step(cinfo, mcusPerStep);
+	if (loadThreads < 2 || stepH == 0 || (size_t)w * h < (1 << 20))
+		return false;
+	int nbSteps = (cinfo->image_height + stepH - 1) / stepH;
+	// Steps covering the requested rows
+	int s0 = y * scale / stepH;
+	int s1 = ((y + h) * scale + stepH - 1) / stepH;
+	if (s1 > nbSteps)
+		s1 = nbSteps;
+	int nb = loadThreads < s1 - s0 ? loadThreads : s1 - s0;
+	struct jpeg_index idx;
+	if (nb < 2 || !index_jpeg(file, cinfo, s1, idx))
+		return false;
+
+	struct jpeg_band *bands = (struct jpeg_band *)calloc(nb, sizeof(struct jpeg_band));
+	bool ok = bands != NULL;
+	for (int i = 0; ok && i < nb; i++) {
+		struct jpeg_band *b = bands + i;
+		int b0 = s0 + i * (s1 - s0) / nb;
+		int b1 = s0 + (i + 1) * (s1 - s0) / nb;
+		// Output rows of the band needed in buf
+		int o0 = b0 * stepH / scale, o1 = (b1 * stepH + scale - 1) / scale;
+		if (o0 < y)
+			o0 = y;
+		if (o1 > y + h)
+			o1 = y + h;
+		init_band(b, idx, cinfo->image_height, b0, b1, scale, x, w, o0, o1,
+			  buf + (size_t)(o0 - y) * 3 * w);
+		b->cancel = file.cancel;
+		if (b->rows <= 0) {
+			b->rows = 0;
+			b->ok = true;
+		} else if (pthread_create(&b->th, NULL, decode_jpeg_band, b) != 0)
+			b->rows = 0;
+	}
+	for (int i = 0; ok && i < nb; i++) {
+		if (bands[i].rows > 0)
+			pthread_join(bands[i].th, NULL);
+	}
+	for (int i = 0; ok && i < nb; i++)
+		ok = bands[i].ok;
+	if (ok && verbose)
+		fprintf(stderr, "Decoded %s in %d bands\n", file.name, nb);
+	free(bands);
+	free_index(idx);
+	return ok;
+}
+
+static int reduce_8(int iW, int iH)
+{
+	return 8;
+}
+
+// Tiles of a jpeg image are bands of steps, see read_jpeg_bands()
+class JpegTiles:public TileSource {
+ public:
+	JpegTiles(const struct image_file &vfile, struct jpeg_index &vidx, int vw,
+		  int vh, int vsteps):file(vfile), idx(vidx), w(vw), h(vh), steps(vsteps) {
+		// The image file is kept open for the overview
+		file.name = strdup(vfile.name);
+		file.fd = dup(vfile.fd);
+		file.cancel = 0;
+	}
+	~JpegTiles() {
+		free_index(idx);
+		close_image_file(file);
+		free((void *)file.name);
+	}
+	bool read(int worker, int level, int tx, int ty, unsigned char *out) {
+		int b0 = ty * steps;
+		int b1 = b0 + steps < idx.nbSteps ? b0 + steps : idx.nbSteps;
+		int o1 = b1 * idx.stepH < h ? b1 * idx.stepH : h;
+		struct jpeg_band b;
+		init_band(&b, idx, h, b0, b1, 1, 0, w, b0 * idx.stepH, o1, out);
+		decode_jpeg_band(&b);
+		return b.ok;
+	}
+	// The image reduced by 8 by libjpeg, then sampled
+	bool overview(int ovs, int ow, int oh, unsigned char *out) {
+		int iW, iH, scale, x, y, rw, rh;
+		unsigned char *buf = read_jpeg_roi(file, iW, iH, reduce_8, scale, 0, x, y, rw, rh);
+		if (buf == 0 || scale != 8 || ovs < 8) {
+			free(buf);
+			return false;
+		}
+		int s = ovs / 8;
+		for (int i = 0; i < oh && i * s < rh; i++) {
+			for (int j = 0; j < ow && j * s < rw; j++)
+				memcpy(out + 3 * ((size_t)i * ow + j),
+				       buf + 3 * ((size_t)i * s * rw + j * s), 3);
+		}
+		free(buf);
+		return true;
+	}
+
+	struct image_file file;
+	struct jpeg_index idx;
+	int w, h, steps;
+};
+#endif
 #endif
 
 // Read a jpeg image, returns 0 if not recognized.
 // Returns width, height
-unsigned char *read_jpeg(const char *sFile, int &iW, int &iH)
+unsigned char *read_jpeg(const struct image_file &file, int &iW, int &iH)
+{
+	int x, y, w, h, scale;
+	return read_jpeg_roi(file, iW, iH, 0, scale, 0, x, y, w, h);
+}
+
+// Read the part of a jpeg image returned by roi reduced by the scale returned by reduce (1, 2, 4 or 8),
+// returns 0 if not recognized. Reduction is performed by libjpeg in the DCT domain which is much faster
+// than a full decode.
+// Returns width, height of the whole image, the reduction and the decoded region of the reduced image
+// which may be larger than requested as it is aligned on MCU boundaries.
+unsigned char *read_jpeg_roi(const struct image_file &file, int &iW, int &iH,
+			     scale_func reduce, int &scale, roi_func roi,
+			     int &x, int &y, int &w, int &h)
 {
 #ifdef HAVE_LIBJPEG
-	FILE *f = fopen(sFile, "rb");
+	FILE *f = image_stream(file, true);
 	if (f == NULL)
 		return 0;
 	struct jpeg_decompress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-	cinfo.err = jpeg_std_error(&jerr);
-	jerr.error_exit = error_handler;
+	struct jpeg_error jerr;
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = error_handler;
 
 	unsigned char *buf = 0;
 
 	/* Establish the setjmp return context to prevent jpeglib from exiting. */
-	if (setjmp(env)) {
+	if (setjmp(jerr.env)) {
 		/* If we get here, the JPEG code has signaled an error.
 		 * We need to clean up the JPEG object, close the input file, and return.
 		 */
@@ -140,24 +1350,104 @@ unsigned char *read_jpeg(const char *sFile, int &iW, int &iH)
 	if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK)
 		return 0;
 
+	iW = cinfo.image_width;
+	iH = cinfo.image_height;
+	scale = reduce ? reduce(iW, iH) : 1;
+	if (scale != 2 && scale != 4 && scale != 8)
+		scale = 1;
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = scale;
 	jpeg_calc_output_dimensions(&cinfo);
-	iW = cinfo.output_width;
-	iH = cinfo.output_height;
+	// Size of the reduced image
+	int oW = cinfo.output_width;
+	int oH = cinfo.output_height;
 	// Tell libjpeg to convert to RGB
 	cinfo.out_color_space = JCS_RGB;
 
-	buf = (unsigned char *)malloc(iW * iH * 3);
-	if (buf == NULL)
-		return 0;
+	x = y = 0;
+	w = oW;
+	h = oH;
+	if (roi) {
+		roi(iW, iH, x, y, w, h);
+		x /= scale;
+		y /= scale;
+		w = (w + scale - 1) / scale;
+		h = (h + scale - 1) / scale;
+		if (x < 0) {
+			w += x;
+			x = 0;
+		}
+		if (y < 0) {
+			h += y;
+			y = 0;
+		}
+		if (x + w > oW)
+			w = oW - x;
+		if (y + h > oH)
+			h = oH - y;
+		if (w <= 0 || h <= 0) {
+			x = y = 0;
+			w = oW;
+			h = oH;
+		}
+	}
 
 	jpeg_start_decompress(&cinfo);
 
-	while (cinfo.output_scanline < cinfo.output_height) {
-		unsigned char *pImage = buf + cinfo.output_scanline * 3 * iW;
+#ifdef HAVE_JPEG_CROP_SCANLINE
+	if (w < oW) {
+		JDIMENSION xo = x, wo = w;
+		jpeg_crop_scanline(&cinfo, &xo, &wo);
+		x = xo;
+		w = wo;
+	}
+#else
+	x = 0;
+	w = oW;
+#endif
+#ifndef HAVE_JPEG_SKIP_SCANLINES
+	h += y;
+	y = 0;
+#endif
+
+	buf = (unsigned char *)malloc((size_t)w * h * 3);
+	if (buf == NULL) {
+		jpeg_destroy_decompress(&cinfo);
+		fclose(f);
+		return 0;
+	}
+#ifdef HAVE_JPEG_MEM_SRC
+	// Big images with restart markers are decoded by several threads
+	if (read_jpeg_bands(file, &cinfo, scale, x, y, w, h, buf)) {
+		jpeg_abort_decompress(&cinfo);
+		jpeg_destroy_decompress(&cinfo);
+		fclose(f);
+		return buf;
+	}
+#endif
+#ifdef HAVE_JPEG_SKIP_SCANLINES
+	if (y > 0)
+		jpeg_skip_scanlines(&cinfo, y);
+#endif
+
+	while (cinfo.output_scanline < (JDIMENSION) (y + h)) {
+		if (cancelled(file)) {
+			jpeg_abort_decompress(&cinfo);
+			jpeg_destroy_decompress(&cinfo);
+			fclose(f);
+			free(buf);
+			return 0;
+		}
+		unsigned char *pImage =
+		    buf + (size_t)(cinfo.output_scanline - y) * 3 * w;
 		jpeg_read_scanlines(&cinfo, &pImage, 1);
 	}
 
-	jpeg_finish_decompress(&cinfo);
+	// Rows below the region are not needed
+	if (cinfo.output_scanline < cinfo.output_height)
+		jpeg_abort_decompress(&cinfo);
+	else
+		jpeg_finish_decompress(&cinfo);
 
 	jpeg_destroy_decompress(&cinfo);
 
@@ -169,27 +1459,456 @@ unsigned char *read_jpeg(const char *sFile, int &iW, int &iH)
 #endif
 }
 
-// Read a ppm image, returns 0 if not recognized.
+// Open a jpeg image bigger than minBytes once decoded as tiles, returns 0 if it's smaller or it can't
+// be decoded by bands (see read_jpeg_bands()). Tiles are bands of rows decoded when drawn.
+Tiles *open_jpeg_tiles(const struct image_file &file, int &iW, int &iH,
+		       size_t minBytes)
+{
+#ifdef HAVE_JPEG_MEM_SRC
+	FILE *f = image_stream(file, false);
+	if (f == NULL)
+		return 0;
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error jerr;
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = error_handler;
+	if (setjmp(jerr.env)) {
+		jpeg_destroy_decompress(&cinfo);
+		fclose(f);
+		return 0;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, f);
+	Tiles *tiles = 0;
+	struct jpeg_index idx;
+	if (jpeg_read_header(&cinfo, TRUE) == JPEG_HEADER_OK
+	    && (size_t)cinfo.image_width * cinfo.image_height * 3 >= minBytes
+	    && index_jpeg(file, &cinfo, cinfo.image_height, idx)) {
+		iW = cinfo.image_width;
+		iH = cinfo.image_height;
+		// Bands of about 4MB
+		size_t stepBytes = (size_t)iW * idx.stepH * 3;
+		int steps = (4 << 20) / stepBytes;
+		if (steps < 1)
+			steps = 1;
+		if (stepBytes > (64 << 20))
+			free_index(idx);
+		else {
+			if (verbose)
+				fprintf(stderr, "open_jpeg_tiles %s w %d h %d step %d\n",
+					file.name, iW, iH, idx.stepH);
+			int n = loadThreads > 0 ? loadThreads : 1;
+			tiles = new Tiles(new JpegTiles(file, idx, iW, iH, steps),
+					  iW, iH, iW, steps * idx.stepH, 1, 1, n);
+		}
+	}
+	jpeg_destroy_decompress(&cinfo);
+	fclose(f);
+	return tiles;
+#else
+	return 0;
+#endif
+}
+
+#ifdef HAVE_LIBTIFF
+// libtiff reads through the descriptor of the image file with pread, each handle at its own
+// position, so that the file isn't opened again
+struct tiff_io {
+	int fd;
+	toff_t pos, size;
+};
+
+static tsize_t tiff_read(thandle_t h, tdata_t buf, tsize_t n)
+{
+	struct tiff_io *io = (struct tiff_io *)h;
+	ssize_t r = pread(io->fd, buf, n, io->pos);
+	if (r > 0)
+		io->pos += r;
+	return r;
+}
+
+static tsize_t tiff_write(thandle_t h, tdata_t buf, tsize_t n)
+{
+	return -1;
+}
+
+static toff_t tiff_seek(thandle_t h, toff_t off, int whence)
+{
+	struct tiff_io *io = (struct tiff_io *)h;
+	if (whence == SEEK_SET)
+		io->pos = off;
+	else if (whence == SEEK_CUR)
+		io->pos += off;
+	else if (whence == SEEK_END)
+		io->pos = io->size + off;
+	return io->pos;
+}
+
+static int tiff_close(thandle_t h)
+{
+	free(h);
+	return 0;
+}
+
+static toff_t tiff_size(thandle_t h)
+{
+	return ((struct tiff_io *)h)->size;
+}
+
+static int tiff_map(thandle_t h, tdata_t * base, toff_t * size)
+{
+	return 0;
+}
+
+static void tiff_unmap(thandle_t h, tdata_t base, toff_t size)
+{
+}
+
+static TIFF *open_tiff(const char *name, int fd, size_t size)
+{
+	struct tiff_io *io = (struct tiff_io *)malloc(sizeof(struct tiff_io));
+	if (io == NULL)
+		return 0;
+	io->fd = fd;
+	io->pos = 0;
+	io->size = size;
+	TIFF *tif = TIFFClientOpen(name, "r", (thandle_t) io, tiff_read, tiff_write,
+				   tiff_seek, tiff_close, tiff_size, tiff_map, tiff_unmap);
+	if (tif == 0)
+		free(io);
+	return tif;
+}
+#endif
+
+// Map an 8 bits RGB tiff image without copying it, returns 0 if not recognized.
+// Only uncompressed, chunky images whose strips are contiguous in the file can be mapped.
+// Gray images are only mapped if nc is given, see read_ppm().
+unsigned char *map_tiff(const struct image_file &file, int &iW, int &iH,
+			void *&map, size_t &mapLen, int *nc)
+{
+#ifdef HAVE_LIBTIFF
+	TIFF *tif = open_tiff(file.name, file.fd, file.size);
+	if (!tif)
+		return 0;
+	uint32_t tw = 0, th = 0;
+	uint16_t c = 0, bs = 0, cp = 0, pc = 0, ph = 0, fo = 1;
+	toff_t *offsets = 0, *counts = 0;
+	bool ok = !TIFFIsTiled(tif)
+	    && TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &tw)
+	    && TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &th)
+	    && TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &c) && (c == 3 || (c == 1 && nc))
+	    && TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bs) && bs == 8
+	    && TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION, &cp)
+	    && cp == COMPRESSION_NONE
+	    && TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &pc)
+	    && pc == PLANARCONFIG_CONTIG
+	    && TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &ph)
+	    && ph == (c == 3 ? PHOTOMETRIC_RGB : PHOTOMETRIC_MINISBLACK)
+	    && (!TIFFGetField(tif, TIFFTAG_FILLORDER, &fo) || fo == 1)
+	    && TIFFGetField(tif, TIFFTAG_STRIPOFFSETS, &offsets)
+	    && TIFFGetField(tif, TIFFTAG_STRIPBYTECOUNTS, &counts)
+	    && tw > 0 && tw <= 65536 && th > 0 && th <= 65536;
+	size_t offset = 0;
+	if (ok) {
+		// Strips must follow each other so that the raster is one contiguous block
+		uint32_t n = TIFFNumberOfStrips(tif);
+		offset = offsets[0];
+		for (uint32_t s = 1; s < n && ok; s++)
+			ok = offsets[s] == offsets[s - 1] + counts[s - 1];
+	}
+	TIFFClose(tif);
+	if (!ok)
+		return 0;
+	iW = tw;
+	iH = th;
+	if (verbose)
+		fprintf(stderr, "map_tiff %s w %d h %d #c %d\n", file.name, iW, iH, c);
+	unsigned char *buf = map_raster(file, offset, (size_t)iW * iH * c, map, mapLen);
+	if (buf && nc)
+		*nc = c;
+	return buf;
+#else
+	return 0;
+#endif
+}
+
+#ifdef HAVE_LIBTIFF
+// Copy n pixels of c samples of nb bytes as RGB, or as gray if oc is 1.
+// 3 channels or more (alpha) use only the first 3 ones, gray is converted to RGB.
+static void tiff_to_rgb(const void *in, unsigned char *out, size_t n, int c,
+			int nb, int oc = 3)
+{
+	if (oc == 1) {
+		for (size_t i = 0; i < n; i++, out += nb)
+			memcpy(out, (const unsigned char *)in + i * c * nb, nb);
+	} else if (nb == 1) {
+		const unsigned char *p = (const unsigned char *)in;
+		for (size_t i = 0; i < n; i++, p += c, out += 3) {
+			out[0] = p[0];
+			out[1] = p[c >= 3 ? 1 : 0];
+			out[2] = p[c >= 3 ? 2 : 0];
+		}
+	} else {
+		const unsigned short *p = (const unsigned short *)in;
+		unsigned short *o = (unsigned short *)out;
+		for (size_t i = 0; i < n; i++, p += c, o += 3) {
+			o[0] = p[0];
+			o[1] = p[c >= 3 ? 1 : 0];
+			o[2] = p[c >= 3 ? 2 : 0];
+		}
+	}
+}
+
+// Decode strips [s0,s1[ of rs rows of a tiff image into their rows of buf, pixels of oc samples,
+// returns false if out of memory or cancelled. Strips which can't be decoded are left as they are.
+static bool read_tiff_strips(TIFF * tif, uint32_t s0, uint32_t s1, int rs, int iW,
+			     int iH, int c, int nb, int oc, unsigned char *buf,
+			     volatile bool *cancel)
+{
+	tdata_t bufstrip = _TIFFmalloc(TIFFStripSize(tif));
+	if (bufstrip == NULL)
+		return false;
+	for (uint32_t strip = s0; strip < s1 && (size_t)strip * rs < (size_t)iH; strip++) {
+		if (cancel && *cancel) {
+			_TIFFfree(bufstrip);
+			return false;
+		}
+		int row = strip * rs;
+		TIFFReadEncodedStrip(tif, strip, bufstrip, (tsize_t) - 1);
+		int rows = rs < iH - row ? rs : iH - row;
+		tiff_to_rgb(bufstrip, buf + (size_t)row * iW * oc * nb, (size_t)rows * iW, c, nb, oc);
+	}
+	_TIFFfree(bufstrip);
+	return true;
+}
+
+// Strips decoded by a thread with its own handle, see read_tiff_bands()
+struct tiff_band {
+	const struct image_file *file;
+	uint32_t s0, s1;
+	int rs, iW, iH, c, nb, oc;
+	unsigned char *buf;
+	bool ok;
+	pthread_t th;
+};
+
+static void *decode_tiff_band(void *arg)
+{
+	struct tiff_band *b = (struct tiff_band *)arg;
+	TIFF *tif = open_tiff(b->file->name, b->file->fd, b->file->size);
+	if (tif) {
+		b->ok = read_tiff_strips(tif, b->s0, b->s1, b->rs, b->iW, b->iH, b->c, b->nb,
+					 b->oc, b->buf, b->file->cancel);
+		TIFFClose(tif);
+	}
+	return 0;
+}
+
+// Decode the nbStrips strips of a tiff image into buf using several threads, returns false
+// if the image isn't worth splitting or a thread failed.
+// Compressed strips are independent, each thread decodes consecutive strips.
+static bool read_tiff_bands(const struct image_file &file, uint32_t nbStrips, int rs,
+			    int iW, int iH, int c, int nb, int oc, unsigned char *buf)
+{
+	int n = loadThreads < (int)nbStrips ? loadThreads : (int)nbStrips;
+	if (n < 2 || (size_t)iW * iH < (1 << 20))
+		return false;
+	struct tiff_band *bands = (struct tiff_band *)calloc(n, sizeof(struct tiff_band));
+	if (bands == NULL)
+		return false;
+	for (int i = 0; i < n; i++) {
+		struct tiff_band *b = bands + i;
+		b->file = &file;
+		b->s0 = (uint64_t)nbStrips * i / n;
+		b->s1 = (uint64_t)nbStrips * (i + 1) / n;
+		b->rs = rs;
+		b->iW = iW;
+		b->iH = iH;
+		b->c = c;
+		b->nb = nb;
+		b->oc = oc;
+		b->buf = buf;
+		if (pthread_create(&b->th, NULL, decode_tiff_band, b) != 0)
+			b->s1 = b->s0;
+	}
+	bool ok = true;
+	for (int i = 0; i < n; i++) {
+		if (bands[i].s1 > bands[i].s0)
+			pthread_join(bands[i].th, NULL);
+		ok = ok && bands[i].ok;
+	}
+	if (ok && verbose)
+		fprintf(stderr, "Decoded %s in %d bands\n", file.name, n);
+	free(bands);
+	return ok;
+}
+
+// Tiles of a tiff, each decoding thread has its own handle on the descriptor of the file.
+// Images made of strips are split in bands of rps rows strips.
+class TiffTiles:public TileSource {
+ public:
+	TiffTiles(const struct image_file &vfile, int vc, int vnb, int vtw, int vth,
+		  bool vtiled, int vrps, int vn):file(strdup(vfile.name)), fd(dup(vfile.fd)),
+	    size(vfile.size), c(vc), nb(vnb), tw(vtw), th(vth), tiled(vtiled), rps(vrps), n(vn) {
+		tif = (TIFF **) calloc(n, sizeof(TIFF *));
+		raw = (tdata_t *) calloc(n, sizeof(tdata_t));
+	}
+	~TiffTiles() {
+		for (int i = 0; i < n; i++) {
+			if (tif[i])
+				TIFFClose(tif[i]);
+			if (raw[i])
+				_TIFFfree(raw[i]);
+		}
+		free(tif);
+		free(raw);
+		free(file);
+		if (fd >= 0)
+			close(fd);
+	}
+	bool read(int worker, int level, int tx, int ty, unsigned char *out);
+
+	char *file;
+	int fd;
+	size_t size;
+	int c, nb, tw, th;
+	bool tiled;
+	int rps, n;
+	TIFF **tif;
+	tdata_t *raw;
+};
+
+bool TiffTiles::read(int worker, int level, int tx, int ty,
+			 unsigned char *out)
+{
+	if (tif == NULL || raw == NULL || worker >= n || fd < 0)
+		return false;
+	if (tif[worker] == 0) {
+		TIFF *t = open_tiff(file, fd, size);
+		if (t == 0)
+			return false;
+		uint16_t cp = 0, ph = 0;
+		TIFFGetFieldDefaulted(t, TIFFTAG_COMPRESSION, &cp);
+		TIFFGetField(t, TIFFTAG_PHOTOMETRIC, &ph);
+		// Let libjpeg convert YCbCr tiles
+		if (cp == COMPRESSION_JPEG && ph == PHOTOMETRIC_YCBCR)
+			TIFFSetField(t, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+		raw[worker] = _TIFFmalloc(tiled ? TIFFTileSize(t) : TIFFStripSize(t));
+		if (raw[worker] == NULL) {
+			TIFFClose(t);
+			return false;
+		}
+		tif[worker] = t;
+	}
+	TIFF *t = tif[worker];
+	if (tiled) {
+		if (TIFFReadEncodedTile(t, TIFFComputeTile(t, tx * tw, ty * th, 0, 0),
+					raw[worker], (tsize_t) - 1) < 0)
+			return false;
+		tiff_to_rgb(raw[worker], out, (size_t)tw * th, c, nb);
+		return true;
+	}
+	// A band of strips, the last strip of the image may be shorter
+	uint32_t nbStrips = TIFFNumberOfStrips(t);
+	for (int r = 0; r < th; r += rps) {
+		uint32_t s = ((size_t)ty * th + r) / rps;
+		if (s >= nbStrips)
+			break;
+		tsize_t len = TIFFReadEncodedStrip(t, s, raw[worker], (tsize_t) - 1);
+		if (len < 0)
+			return false;
+		size_t np = len / (c * nb);
+		if (np > (size_t)rps * tw)
+			np = (size_t)rps * tw;
+		tiff_to_rgb(raw[worker], out + (size_t)r * tw * 3 * nb, np, c, nb);
+	}
+	return true;
+}
+#endif
+
+// Open a tiff as tiles decoded when drawn, returns 0 if not recognized.
+// Tiled images are always opened this way, images made of strips only when they are bigger
+// than minBytes once decoded.
+// Returns width, height, nb of bytes (1 or 2) and max value for 16 bits imagery, sampled as
+// for read_tiff(), which computes it, see sample_max().
+Tiles *open_tiff_tiles(const struct image_file &file, int &iW, int &iH,
+		       int &nbBytes, int &max, size_t minBytes)
+{
+#ifdef HAVE_LIBTIFF
+	TIFF *tif = open_tiff(file.name, file.fd, file.size);
+	if (!tif)
+		return 0;
+	uint32_t tw = 0, th = 0, w = 0, h = 0, rps = 0;
+	uint16_t c = 0, bs = 0, pc = 0, ph = 0, cp = 0, fo = 1;
+	bool tiled = TIFFIsTiled(tif);
+	bool ok = TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w)
+	    && TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h)
+	    && TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &c)
+	    && TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bs)
+	    && TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &pc)
+	    && TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION, &cp)
+	    && TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &ph)
+	    && (!TIFFGetField(tif, TIFFTAG_FILLORDER, &fo) || fo == 1)
+	    && pc == PLANARCONFIG_CONTIG && (bs == 8 || bs == 16)
+	    && (ph == PHOTOMETRIC_MINISBLACK || ph == PHOTOMETRIC_RGB
+		|| (ph == PHOTOMETRIC_YCBCR && cp == COMPRESSION_JPEG))
+	    && (c == 1 || c >= 3) && w > 0 && h > 0 && w < (1u << 31)
+	    && h < (1u << 31);
+	if (ok && tiled)
+		ok = TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tw)
+		    && TIFFGetField(tif, TIFFTAG_TILELENGTH, &th) && tw > 0 && th > 0;
+	else if (ok) {
+		ok = (size_t)w * h * 3 * (bs / 8) >= minBytes
+		    && TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rps) && rps > 0;
+		if (ok) {
+			if (rps > h)
+				rps = h;
+			// Bands of about 4MB
+			tw = w;
+			th = rps * (1 + ((4 << 20) / ((size_t)w * 3 * (bs / 8))) / rps);
+			if (th > h)
+				th = h;
+			ok = (size_t)tw * th * 3 * (bs / 8) <= (64 << 20);
+		}
+	}
+	TIFFClose(tif);
+	if (!ok)
+		return 0;
+	iW = w;
+	iH = h;
+	nbBytes = bs / 8;
+	int n = loadThreads > 0 ? loadThreads : 1;
+	TiffTiles *src = new TiffTiles(file, c, nbBytes, tw, th, tiled, rps, n);
+	max = bs == 16 ? sample_max(src, iW, iH, tw, th) : 255;
+	if (verbose)
+		fprintf(stderr, "open_tiff_tiles %s w %d h %d #c %d bps %d tile %d %d max %d\n",
+			file.name, iW, iH, c, bs, tw, th, max);
+	return new Tiles(src, iW, iH, tw, th, nbBytes, 1, n);
+#else
+	return 0;
+#endif
+}
+
+// Read a tiff image, returns 0 if not recognized.
 // Returns width, height, nb of bytes (1 or 2) and max value for 16 bits imagery.
 // Max value is used in case a 16 bits image has less significant bits (eg 12 or 14 for some camera).
-unsigned char *read_tiff(const char *file, int &iW, int &iH, int &nbBytes,
-			 int &max)
+// Gray images are kept as 1 sample per pixel if nc is given, see read_ppm().
+unsigned char *read_tiff(const struct image_file &file, int &iW, int &iH,
+			 int &nbBytes, int &max, int *nc)
 {
 #ifdef HAVE_LIBTIFF
-	// reject NEF files which could be recognized as TIFF
-	if (strlen(file) >= 3
-	    && strcasecmp(file + strlen(file) - 3, "nef") == 0)
-		return 0;
-	TIFF *tif = TIFFOpen(file, "r");
+	TIFF *tif = open_tiff(file.name, file.fd, file.size);
 	if (tif) {
 		TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &iW);
 		TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &iH);
-		uint16_t c = 0xFFFF, bs = 8, fo = 1, rs = 1, tw = 1, tl =
-		    1, ph = 0, es = 0;
+		uint16_t c = 0xFFFF, bs = 8, fo = 1, ph = 0, es = 0;
+		uint32_t rs = 1, tw = 1, tl = 1;
 		uint16_t *esv;
 		TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &c);
 		TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bs);
-		TIFFGetField(tif, TIFFTAG_ROWSPERSTRIP, &rs);
+		TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rs);
+		if (rs > (uint32_t)iH)	// Default is 2^32-1, a single strip
+			rs = iH;
 		TIFFGetField(tif, TIFFTAG_FILLORDER, &fo);
 		TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tw);
 		TIFFGetField(tif, TIFFTAG_TILELENGTH, &tl);
@@ -198,7 +1917,7 @@ unsigned char *read_tiff(const char *file, int &iW, int &iH, int &nbBytes,
 		if (verbose)
 			fprintf(stderr,
 				"read_tiff %s w %d h %d #c %d bps %d fo %d tile %d %d photo %d es %d\n",
-				file, iW, iH, c, bs, fo, tw, tl, ph, es);
+				file.name, iW, iH, c, bs, fo, tw, tl, ph, es);
 		if (c == 0xFFFF)	// Try to guess number of chanels
 		{
 			if (ph == PHOTOMETRIC_MINISBLACK) {
@@ -212,7 +1931,7 @@ unsigned char *read_tiff(const char *file, int &iW, int &iH, int &nbBytes,
 			c += es;
 		}
 
-		if (fo == 2 || tw != 1 || tl != 1 || (ph != PHOTOMETRIC_MINISBLACK && ph != PHOTOMETRIC_RGB))	// Don't handle odd fill order or tiled tiff
+		if (fo == 2 || TIFFIsTiled(tif) || (ph != PHOTOMETRIC_MINISBLACK && ph != PHOTOMETRIC_RGB))	// Don't handle odd fill order or tiled tiff
 		{
 			TIFFClose(tif);
 			return 0;
@@ -231,163 +1950,29 @@ unsigned char *read_tiff(const char *file, int &iW, int &iH, int &nbBytes,
 			return 0;
 		}
 
-		tdata_t bufstrip;
-		bufstrip = _TIFFmalloc(TIFFStripSize(tif));
-		if (bufstrip == NULL) {
-			TIFFClose(tif);
-			return 0;
-		}
+		int oc = nc && ph == PHOTOMETRIC_MINISBLACK && c < 3 ? 1 : 3;
 		unsigned char *buf =
-		    (unsigned char *)malloc(iW * iH * 3 * nbBytes);
+		    (unsigned char *)malloc((size_t)iW * iH * oc * nbBytes);
 		if (buf == NULL) {
-			_TIFFfree(bufstrip);
 			TIFFClose(tif);
 			return 0;
 		}
 
-		int row = 0;
-		for (unsigned int strip = 0; strip < TIFFNumberOfStrips(tif);
-		     strip++) {
-			TIFFReadEncodedStrip(tif, strip, bufstrip,
-					     (tsize_t) - 1);
-			if (nbBytes == 1)	// Case of standard 8 bits images
-			{
-				unsigned char *p = (unsigned char *)bufstrip;
-				for (int rowS = 0; rowS < rs && row < iH;
-				     rowS++) {
-					for (int col = 0; col < iW; col++) {
-						// 3 channels or more (alpha) use only the first 3 ones
-						if (c >= 3) {
-							for (int cha = 0;
-							     cha < 3; cha++) {
-								buf[3 *
-								    (row * iW +
-								     col) +
-								    cha] =
-								    p[c *
-								      (col +
-								       rowS *
-								       iW) +
-								      cha];
-							}
-						} else {
-							buf[3 *
-							    (row * iW + col) +
-							    0] =
-							    buf[3 *
-								(row * iW +
-								 col) + 1] =
-							    buf[3 *
-								(row * iW +
-								 col) + 2] =
-							    p[rowS * iW + col];
-						}
-					}
-					row++;
-				}
-			} else if (nbBytes == 2)	// Case of 16 bits imagery
-			{
-				unsigned short *p = (unsigned short *)bufstrip;
-				unsigned short *b = (unsigned short *)buf;
-				for (int rowS = 0; rowS < rs && row < iH;
-				     rowS++) {
-					for (int col = 0; col < iW; col++) {
-						// 3 channels or more (alpha) use only the first 3 ones
-						if (c >= 3) {
-							for (int cha = 0;
-							     cha < 3; cha++) {
-								if (endian())
-									b[3 *
-									  (row *
-									   iW +
-									   col)
-									  +
-									  cha] =
-									p[c *
-									  (col +
-									   rowS
-									   *
-									   iW) +
-									  cha];
-								else
-									b[3 *
-									  (row *
-									   iW +
-									   col)
-									  +
-									  cha] =
-									swap(p
-									     [c
-									      *
-									      (col
-									       +
-									       rowS
-									       *
-									       iW)
-									      +
-									      cha]);
-
-								if (b
-								    [3 *
-								     (row * iW +
-								      col) +
-								     cha] > max)
-									max =
-									    b[3
-									      *
-									      (row
-									       *
-									       iW
-									       +
-									       col)
-									      +
-									      cha];
-							}
-						} else	// Convert Gray -> RGB
-						{
-							if (endian())
-								b[3 *
-								  (row * iW +
-								   col) + 0] =
-								b[3 *
-								  (row * iW +
-								   col) + 1] =
-								b[3 *
-								  (row * iW +
-								   col) + 2] =
-								p[rowS * iW +
-								  col];
-							else
-								b[3 *
-								  (row * iW +
-								   col) + 0] =
-								b[3 *
-								  (row * iW +
-								   col) + 1] =
-								b[3 *
-								  (row * iW +
-								   col) + 2] =
-								swap(p
-								     [rowS *
-								      iW +
-								      col]);
-							if (b
-							    [3 *
-							     (row * iW + col) +
-							     0] > max)
-								max =
-								    b[3 *
-								      (row *
-								       iW +
-								       col) +
-								      0];
-						}
-					}
-					row++;
-				}
-			}
+		// Strips are decoded in parallel when there are enough of them
+		uint32_t nbStrips = TIFFNumberOfStrips(tif);
+		if (!read_tiff_bands(file, nbStrips, rs, iW, iH, c, nbBytes, oc, buf)
+		    && (cancelled(file)
+			|| !read_tiff_strips(tif, 0, nbStrips, rs, iW, iH, c, nbBytes, oc, buf,
+					     file.cancel))) {
+			free(buf);
+			TIFFClose(tif);
+			return 0;
 		}
-		_TIFFfree(bufstrip);
+		// Compute max value of 16 bits imagery
+		if (nbBytes == 2)
+			max = swap_max((unsigned short *)buf, (size_t)iW * iH * oc, false);
+		if (nc)
+			*nc = oc;
 
 		TIFFClose(tif);
 		return buf;
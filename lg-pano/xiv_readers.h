@@ -1,9 +1,62 @@
 #ifndef _xiv_readers_h_
 #define _xiv_readers_h_
 
-unsigned char* read_ppm(const char* sFile, int& iW, int& iH, int& nbBytes, int& max);
-unsigned char* read_jpeg(const char* sFile, int& iW, int& iH);
-unsigned char* read_tiff(const char* file, int& iW, int& iH, int& nbBytes, int& max);
+#include <stddef.h>
+#include "xiv_tiles.h"
 
+// Readers given nc keep gray images as 1 sample per pixel and set nc to 1, or to 3 for RGB.
+// Without it, gray images are expanded to RGB.
+
+// Called with the size of the image, sets the region worth decoding
+typedef void (*roi_func)(int iW, int iH, int& x, int& y, int& w, int& h);
+// Called with the size of the image, returns the reduction to decode it at
+typedef int (*scale_func)(int iW, int iH);
+
+// Formats recognized from the first bytes of a file
+enum
+  {
+    IMAGE_OTHER,      // Converted by ImageMagick
+    IMAGE_PYRAMID,
+    IMAGE_PPM,
+    IMAGE_JPEG,
+    IMAGE_TIFF,
+    IMAGE_PNG
+  };
+
+// An image file opened once, its descriptor and first bytes are shared by all the readers
+struct image_file
+{
+  const char* name;
+  int fd;
+  size_t size;
+  int format;
+  unsigned char head[4096];
+  size_t headLen;
+  // Set by another thread to stop the readers between rows, strips or bands, they then
+  // return 0. Null when the reading can't be cancelled.
+  volatile bool* cancel;
+};
+
+inline bool cancelled(const struct image_file& f)
+{
+  return f.cancel != 0 && *f.cancel;
+}
+
+bool open_image_file(const char* name, struct image_file& f);
+void close_image_file(struct image_file& f);
+int read_orientation(const struct image_file& f);
+
+unsigned char* read_ppm(const struct image_file& f, int& iW, int& iH, int& nbBytes, int& max, int* nc = 0);
+unsigned char* read_jpeg(const struct image_file& f, int& iW, int& iH);
+unsigned char* read_jpeg_roi(const struct image_file& f, int& iW, int& iH, scale_func reduce, int& scale, roi_func roi, int& x, int& y, int& w, int& h);
+unsigned char* read_tiff(const struct image_file& f, int& iW, int& iH, int& nbBytes, int& max, int* nc = 0);
+unsigned char* read_png(const struct image_file& f, int& iW, int& iH, int& nbBytes, int& max, int* nc = 0);
+unsigned char* read_converted(const char* sFile, int& iW, int& iH, int& nbBytes, int& max, int* nc = 0);
+unsigned char* map_ppm(const struct image_file& f, int& iW, int& iH, void*& map, size_t& mapLen, int* nc = 0);
+unsigned char* map_tiff(const struct image_file& f, int& iW, int& iH, void*& map, size_t& mapLen, int* nc = 0);
+Tiles* open_ppm_tiles(const struct image_file& f, int& iW, int& iH, int& max, size_t minBytes);
+Tiles* open_jpeg_tiles(const struct image_file& f, int& iW, int& iH, size_t minBytes);
+Tiles* open_tiff_tiles(const struct image_file& f, int& iW, int& iH, int& nbBytes, int& max, size_t minBytes);
+Tiles* open_pyramid_tiles(const struct image_file& f, int& iW, int& iH, int& nbBytes, int& max);
 
 #endif
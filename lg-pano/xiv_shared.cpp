@@ -0,0 +1,403 @@
+#include "xiv_shared.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+extern bool verbose;
+extern bool autorot;
+
+#define SHARED_MAGIC "XIVSHM3"
+#define SHARED_ENTRIES 256
+#define SHARED_PROCS 64
+
+enum {
+	ENTRY_FREE,
+	ENTRY_LOADING,		// Being decoded by process pid
+	ENTRY_READY
+};
+
+struct shared_entry {
+	// Key: the file and its modification time
+	uint64_t dev, ino, size;
+	int64_t sec, nsec;
+	int32_t autorot;
+	int32_t state;
+	int32_t pid;
+	uint32_t id;		// Raster is in file /dev/shm/xiv-<uid>-<id>
+	uint64_t bytes;
+	uint64_t used;		// Last use, for the LRU
+	struct shared_raster r;
+};
+
+struct shared_index {
+	char magic[8];
+	pthread_mutex_t mutex;
+	uint32_t nextId;
+	uint64_t tick;
+	uint64_t budget;		// Given by the process which created the index
+	int32_t procs[SHARED_PROCS];	// Processes using the cache
+	struct shared_entry e[SHARED_ENTRIES];
+};
+
+static struct shared_index *idx = 0;
+
+static void index_path(char *path, size_t len)
+{
+	snprintf(path, len, "/dev/shm/xiv-%d", (int)getuid());
+}
+
+static void raster_path(uint32_t id, char *path, size_t len)
+{
+	snprintf(path, len, "/dev/shm/xiv-%d-%u", (int)getuid(), id);
+}
+
+static void lock_index()
+{
+	// A process died holding the lock, the index is still usable
+	if (pthread_mutex_lock(&idx->mutex) == EOWNERDEAD)
+		pthread_mutex_consistent(&idx->mutex);
+}
+
+static void unlock_index()
+{
+	pthread_mutex_unlock(&idx->mutex);
+}
+
+static bool alive(int pid)
+{
+	return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+// Free entry e and its raster, called with the index locked
+static void free_entry(struct shared_entry *e)
+{
+	if (e->state == ENTRY_READY) {
+		char path[64];
+		raster_path(e->id, path, sizeof(path));
+		unlink(path);
+	}
+	e->state = ENTRY_FREE;
+}
+
+static bool file_key(const char *file, struct shared_entry &k)
+{
+	struct stat st;
+	if (stat(file, &st) != 0 || !S_ISREG(st.st_mode))
+		return false;
+	memset(&k, 0, sizeof(k));
+	k.dev = st.st_dev;
+	k.ino = st.st_ino;
+	k.size = st.st_size;
+	k.sec = st.st_mtim.tv_sec;
+	k.nsec = st.st_mtim.tv_nsec;
+	k.autorot = autorot;
+	return true;
+}
+
+// Entry of key k, called with the index locked.
+// Entries left loading by dead processes are freed.
+static struct shared_entry *find_entry(const struct shared_entry &k)
+{
+	for (int i = 0; i < SHARED_ENTRIES; i++) {
+		struct shared_entry *e = idx->e + i;
+		if (e->state != ENTRY_FREE && e->dev == k.dev && e->ino == k.ino
+		    && e->size == k.size && e->sec == k.sec && e->nsec == k.nsec
+		    && e->autorot == k.autorot) {
+			if (e->state == ENTRY_LOADING && !alive(e->pid)) {
+				free_entry(e);
+				return 0;
+			}
+			return e;
+		}
+	}
+	return 0;
+}
+
+// Evict the least recently used rasters until bytes more fit in the budget.
+// Called with the index locked.
+static void make_room(size_t bytes)
+{
+	for (;;) {
+		size_t total = 0;
+		struct shared_entry *lru = 0;
+		for (int i = 0; i < SHARED_ENTRIES; i++) {
+			struct shared_entry *e = idx->e + i;
+			if (e->state == ENTRY_READY) {
+				total += e->bytes;
+				if (lru == 0 || e->used < lru->used)
+					lru = e;
+			}
+		}
+		if (total + bytes <= idx->budget || lru == 0)
+			return;
+		if (verbose)
+			fprintf(stderr, "Evict shared raster %u\n", lru->id);
+		free_entry(lru);
+	}
+}
+
+// Free entry, evicting the least recently used raster if there's none.
+// Called with the index locked.
+static struct shared_entry *new_entry()
+{
+	struct shared_entry *lru = 0;
+	for (int i = 0; i < SHARED_ENTRIES; i++) {
+		struct shared_entry *e = idx->e + i;
+		if (e->state == ENTRY_FREE)
+			return e;
+		if (e->state == ENTRY_READY && (lru == 0 || e->used < lru->used))
+			lru = e;
+	}
+	if (lru)
+		free_entry(lru);
+	return lru;
+}
+
+bool shared_open(size_t vbudget)
+{
+	char path[64];
+	index_path(path, sizeof(path));
+	bool created = true;
+	int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 && errno == EEXIST) {
+		created = false;
+		fd = open(path, O_RDWR);
+	}
+	if (fd < 0) {
+		fprintf(stderr, "Can't open shared cache %s\n", path);
+		return false;
+	}
+	if (created && ftruncate(fd, sizeof(struct shared_index)) != 0) {
+		fprintf(stderr, "Can't size shared cache %s\n", path);
+		close(fd);
+		unlink(path);
+		return false;
+	}
+	// Wait for the process which created it to size and initialize it
+	struct stat st;
+	for (int i = 0; i < 100 && fstat(fd, &st) == 0 && st.st_size == 0; i++)
+		usleep(10000);
+	if (fstat(fd, &st) != 0 || st.st_size != sizeof(struct shared_index)) {
+		fprintf(stderr, "Shared cache %s is of another version of xiv\n", path);
+		close(fd);
+		return false;
+	}
+	void *m = mmap(NULL, sizeof(struct shared_index), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		fprintf(stderr, "Can't map shared cache %s\n", path);
+		return false;
+	}
+	idx = (struct shared_index *)m;
+	if (created) {
+		pthread_mutexattr_t attr;
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(&idx->mutex, &attr);
+		pthread_mutexattr_destroy(&attr);
+		idx->budget = vbudget;
+		__sync_synchronize();
+		memcpy(idx->magic, SHARED_MAGIC, sizeof(idx->magic));
+	} else {
+		for (int i = 0; i < 100 && memcmp(idx->magic, SHARED_MAGIC, sizeof(idx->magic)) != 0; i++)
+			usleep(10000);
+		__sync_synchronize();
+		if (memcmp(idx->magic, SHARED_MAGIC, sizeof(idx->magic)) != 0) {
+			fprintf(stderr, "Shared cache %s is of another version of xiv\n", path);
+			munmap(idx, sizeof(struct shared_index));
+			idx = 0;
+			return false;
+		}
+	}
+
+	lock_index();
+	// The last process left while this one opened the index, start again with a new one
+	struct stat cur;
+	if (stat(path, &cur) != 0 || cur.st_ino != st.st_ino) {
+		unlock_index();
+		munmap(idx, sizeof(struct shared_index));
+		idx = 0;
+		return shared_open(vbudget);
+	}
+	int slot = -1;
+	for (int i = 0; i < SHARED_PROCS; i++) {
+		if (idx->procs[i] && !alive(idx->procs[i]))
+			idx->procs[i] = 0;
+		if (idx->procs[i] == 0 && slot < 0)
+			slot = i;
+	}
+	if (slot >= 0)
+		idx->procs[slot] = getpid();
+	unlock_index();
+	if (slot < 0) {
+		fprintf(stderr, "Too many processes use the shared cache %s\n", path);
+		munmap(idx, sizeof(struct shared_index));
+		idx = 0;
+		return false;
+	}
+	if (verbose)
+		fprintf(stderr, "%s shared cache %s\n", created ? "Created" : "Joined", path);
+	return true;
+}
+
+void shared_close()
+{
+	if (idx == 0)
+		return;
+	lock_index();
+	bool last = true;
+	for (int i = 0; i < SHARED_PROCS; i++) {
+		if (idx->procs[i] == getpid())
+			idx->procs[i] = 0;
+		else if (idx->procs[i] && alive(idx->procs[i]))
+			last = false;
+	}
+	if (last) {
+		for (int i = 0; i < SHARED_ENTRIES; i++)
+			free_entry(idx->e + i);
+		char path[64];
+		index_path(path, sizeof(path));
+		unlink(path);
+	}
+	unlock_index();
+	munmap(idx, sizeof(struct shared_index));
+	idx = 0;
+}
+
+unsigned char *shared_find(const char *file, bool claim, struct shared_raster &r,
+			   void *&map, size_t &mapLen, volatile bool *cancel)
+{
+	struct shared_entry k;
+	if (idx == 0 || !file_key(file, k))
+		return 0;
+	for (;;) {
+		lock_index();
+		struct shared_entry *e = find_entry(k);
+		if (e == 0) {
+			if (claim && (e = new_entry()) != 0) {
+				*e = k;
+				e->state = ENTRY_LOADING;
+				e->pid = getpid();
+			}
+			unlock_index();
+			return 0;
+		}
+		if (e->state == ENTRY_READY) {
+			e->used = ++idx->tick;
+			uint32_t id = e->id;
+			size_t bytes = e->bytes;
+			r = e->r;
+			unlock_index();
+			// It may be evicted meanwhile
+			char path[64];
+			raster_path(id, path, sizeof(path));
+			int fd = open(path, O_RDONLY);
+			if (fd < 0)
+				return 0;
+			void *m = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+			close(fd);
+			if (m == MAP_FAILED)
+				return 0;
+			map = m;
+			mapLen = bytes;
+			return (unsigned char *)m;
+		}
+		// This process is decoding it
+		if (e->pid == getpid()) {
+			unlock_index();
+			return 0;
+		}
+		unlock_index();
+		// Another process is decoding it
+		if (cancel && *cancel)
+			return 0;
+		usleep(20000);
+	}
+}
+
+unsigned char *shared_publish(const char *file, const struct shared_raster &r,
+			      const unsigned char *buf, void *&map, size_t &mapLen)
+{
+	struct shared_entry k;
+	size_t bytes = (size_t)r.bw * r.bh * r.nc * r.nb;
+	if (idx == 0 || bytes > idx->budget || !file_key(file, k))
+		return 0;
+	lock_index();
+	struct shared_entry *e = find_entry(k);
+	if (e && (e->state == ENTRY_READY || e->pid != getpid())) {
+		// Shared by another process meanwhile
+		unlock_index();
+		return 0;
+	}
+	if (e == 0 && (e = new_entry()) != 0) {
+		*e = k;
+		e->state = ENTRY_LOADING;
+		e->pid = getpid();
+	}
+	uint32_t id = idx->nextId++;
+	unlock_index();
+	if (e == 0)
+		return 0;
+
+	char path[64];
+	raster_path(id, path, sizeof(path));
+	void *m = MAP_FAILED;
+	int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd >= 0) {
+		// Reserve the memory so that a full /dev/shm fails here rather than when writing
+		if (posix_fallocate(fd, 0, bytes) == 0)
+			m = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	if (m != MAP_FAILED)
+		memcpy(m, buf, bytes);
+
+	lock_index();
+	// The entry is only changed by this process while it's loading
+	e = find_entry(k);
+	if (m == MAP_FAILED || e == 0) {
+		if (e)
+			free_entry(e);
+		unlock_index();
+		if (m != MAP_FAILED)
+			munmap(m, bytes);
+		unlink(path);
+		if (verbose)
+			fprintf(stderr, "Can't share the raster of %s\n", file);
+		return 0;
+	}
+	make_room(bytes);
+	e->state = ENTRY_READY;
+	e->id = id;
+	e->bytes = bytes;
+	e->used = ++idx->tick;
+	e->r = r;
+	unlock_index();
+	if (verbose)
+		fprintf(stderr, "Shared the raster of %s\n", file);
+	map = m;
+	mapLen = bytes;
+	return (unsigned char *)m;
+}
+
+void shared_drop(const char *file)
+{
+	struct shared_entry k;
+	if (idx == 0 || !file_key(file, k))
+		return;
+	lock_index();
+	struct shared_entry *e = find_entry(k);
+	if (e && e->state == ENTRY_LOADING && e->pid == getpid())
+		free_entry(e);
+	unlock_index();
+}
@@ -0,0 +1,41 @@
+#ifndef _xiv_shared_h_
+#define _xiv_shared_h_
+
+#include <stddef.h>
+
+// Decoded rasters shared by the xiv processes of a node, e.g. one per screen, through files
+// in /dev/shm. A small index locked by a robust process shared mutex tells which file, of
+// which modification time, each shared raster is. The first process to load an image decodes
+// it and moves its raster to shared memory, the other ones wait for it and map it read only.
+// Rasters are evicted the least recently used first over the budget given to shared_open() by
+// the process which created the index, the processes which mapped them keep them until they
+// unmap them.
+
+// Raster of a shared image, as read by load_image()
+struct shared_raster
+{
+  int w, h;             // Size of the image as stored
+  int nb, nc, max;      // Bytes and samples (3, or 1 for gray) per pixel
+  int orient;
+  int scale;
+  int bx, by, bw, bh;
+};
+
+// Join the shared cache of the user, created with budget bytes if there is none yet,
+// false if it can't be used
+bool shared_open(size_t budget);
+// Leave it, the last process removes it
+void shared_close();
+// Map the raster of file if it's shared, waiting while another process decodes it.
+// Returns 0 if it isn't: if claim is set, other processes then wait for the caller to decode
+// it and call shared_publish() or shared_drop().
+unsigned char* shared_find(const char* file, bool claim, struct shared_raster& r,
+                           void*& map, size_t& mapLen, volatile bool* cancel);
+// Share buf, the raster of file decoded by this process.
+// Returns the shared copy to use instead of buf, 0 if it can't be shared.
+unsigned char* shared_publish(const char* file, const struct shared_raster& r,
+                              const unsigned char* buf, void*& map, size_t& mapLen);
+// Give up the raster of file claimed by shared_find()
+void shared_drop(const char* file);
+
+#endif
@@ -0,0 +1,335 @@
+#include "xiv_tiles.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern bool verbose;
+
+size_t Tiles::budget = 256 << 20;
+
+// All images with tiles and the bytes of their installed tiles
+static pthread_mutex_t mutexTiles = PTHREAD_MUTEX_INITIALIZER;
+static Tiles *allTiles = 0;
+static size_t totalBytes = 0;
+
+// Largest side of overviews
+#define OVERVIEW_SIZE 8192
+
+struct tiles_worker {
+	Tiles *tiles;
+	int n;
+};
+
+// log2 of v if it's a power of 2, -1 otherwise
+static int log2_exact(int v)
+{
+	for (int s = 0; s < 31; s++) {
+		if (v == (1 << s))
+			return s;
+	}
+	return -1;
+}
+
+// Decoding thread, decodes the most recently requested tile first.
+// The first thread starts by decoding the overview if the source can.
+static void *decode_tiles(void *arg)
+{
+	struct tiles_worker *wk = (struct tiles_worker *)arg;
+	Tiles *t = wk->tiles;
+	if (wk->n == 0 && t->ovWanted) {
+		size_t len = (size_t)t->ow * t->oh * 3 * t->nb;
+		unsigned char *ov = (unsigned char *)malloc(len);
+		if (ov && t->src->overview(t->ovs, t->ow, t->oh, ov)) {
+			pthread_mutex_lock(&t->mutex);
+			t->ovDecoded = ov;
+			t->ready = true;
+			pthread_mutex_unlock(&t->mutex);
+		} else
+			free(ov);
+	}
+	pthread_mutex_lock(&t->mutex);
+	while (!t->quit) {
+		if (t->nqueue == 0) {
+			pthread_cond_wait(&t->cond, &t->mutex);
+			continue;
+		}
+		size_t k = t->queue[--t->nqueue];
+		t->state[k] = TILE_LOADING;
+		pthread_mutex_unlock(&t->mutex);
+
+		int l = 0;
+		while (k >= t->base[l + 1])
+			l++;
+		size_t kl = k - t->base[l];
+		unsigned char *buf = (unsigned char *)malloc(t->tileBytes);
+		bool ok = buf != NULL
+		    && t->src->read(wk->n, l, kl % t->nxl[l], kl / t->nxl[l], buf);
+
+		pthread_mutex_lock(&t->mutex);
+		if (ok) {
+			t->decoded[k] = buf;
+			t->done[t->ndone++] = k;
+			t->state[k] = TILE_LOADED;
+			t->ready = true;
+		} else {
+			if (verbose)
+				fprintf(stderr, "Can't decode tile %d %d of level %d\n",
+					(int)(kl % t->nxl[l]), (int)(kl / t->nxl[l]), l);
+			free(buf);
+			t->state[k] = TILE_FAILED;
+		}
+	}
+	pthread_mutex_unlock(&t->mutex);
+	return 0;
+}
+
+Tiles::Tiles(TileSource * vsrc, int vw, int vh, int vtw, int vth, int vnb,
+	     int vlevels, int nthreads)
+:  w(vw), h(vh), tw(vtw), th(vth), nb(vnb), levels(vlevels), level(0),
+levelBase(0), ready(false), src(vsrc), bytes(0), coarse(false), ovDecoded(0),
+ovWanted(true), frameNo(0), nqueue(0), ndone(0), quit(false)
+{
+	nx = (w + tw - 1) / tw;
+	ny = (h + th - 1) / th;
+	if (levels < 1)
+		levels = 1;
+	base = (size_t *)malloc((levels + 1) * sizeof(size_t));
+	nxl = (int *)malloc(levels * sizeof(int));
+	if (base == NULL || nxl == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		exit(1);
+	}
+	base[0] = 0;
+	for (int l = 0; l < levels; l++) {
+		int lw = (int)(((size_t)w + (1 << l) - 1) >> l);
+		int lh = (int)(((size_t)h + (1 << l) - 1) >> l);
+		nxl[l] = (lw + tw - 1) / tw;
+		base[l + 1] = base[l] + (size_t)nxl[l] * ((lh + th - 1) / th);
+	}
+	levelNx = nx;
+	tws = log2_exact(tw);
+	ths = log2_exact(th);
+	tileBytes = (size_t)tw * th * 3 * nb;
+	// Overview is reduced by at least 8
+	for (ovShift = 3; (w >> ovShift) >= OVERVIEW_SIZE
+	     || (h >> ovShift) >= OVERVIEW_SIZE; ovShift++) ;
+	ovs = 1 << ovShift;
+	ow = (w + ovs - 1) / ovs;
+	oh = (h + ovs - 1) / ovs;
+	size_t n = base[levels];
+	overview = (unsigned char *)calloc((size_t)ow * oh * 3, nb);
+	tile = (unsigned char **)calloc(n, sizeof(unsigned char *));
+	decoded = (unsigned char **)calloc(n, sizeof(unsigned char *));
+	used = (unsigned int *)calloc(n, sizeof(unsigned int));
+	state = (volatile char *)calloc(n, sizeof(char));
+	sampled = (char *)calloc((size_t)nx * ny, sizeof(char));
+	queue = (size_t *)malloc(n * sizeof(size_t));
+	done = (size_t *)malloc(n * sizeof(size_t));
+	if (overview == NULL || tile == NULL || decoded == NULL || used == NULL
+	    || state == NULL || sampled == NULL || queue == NULL
+	    || done == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		exit(1);
+	}
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+
+	pthread_mutex_lock(&mutexTiles);
+	prev = 0;
+	next = allTiles;
+	if (allTiles)
+		allTiles->prev = this;
+	allTiles = this;
+	pthread_mutex_unlock(&mutexTiles);
+
+	if (nthreads < 1)
+		nthreads = 1;
+	th_workers = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+	struct tiles_worker *args =
+	    (struct tiles_worker *)malloc(nthreads * sizeof(struct tiles_worker));
+	workers = args;
+	nworkers = 0;
+	for (int i = 0; i < nthreads && th_workers && args; i++) {
+		args[i].tiles = this;
+		args[i].n = i;
+		if (pthread_create(th_workers + i, NULL, decode_tiles, args + i) == 0)
+			nworkers++;
+	}
+	if (nworkers == 0) {
+		fprintf(stderr, "Can't create tile decoding threads\n");
+		exit(1);
+	}
+	if (verbose)
+		fprintf(stderr, "%d x %d tiles of %d x %d, %d levels, overview reduced by %d\n",
+			nx, ny, tw, th, levels, ovs);
+}
+
+Tiles::~Tiles()
+{
+	pthread_mutex_lock(&mutex);
+	quit = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&mutex);
+	for (int i = 0; i < nworkers; i++)
+		pthread_join(th_workers[i], NULL);
+
+	pthread_mutex_lock(&mutexTiles);
+	if (prev)
+		prev->next = next;
+	else
+		allTiles = next;
+	if (next)
+		next->prev = prev;
+	totalBytes -= bytes;
+	pthread_mutex_unlock(&mutexTiles);
+
+	size_t n = base[levels];
+	for (size_t k = 0; k < n; k++) {
+		free(tile[k]);
+		free(decoded[k]);
+	}
+	free(overview);
+	free(ovDecoded);
+	free(tile);
+	free(decoded);
+	free(used);
+	free((void *)state);
+	free(sampled);
+	free(queue);
+	free(done);
+	free(base);
+	free(nxl);
+	free(th_workers);
+	free(workers);
+	pthread_mutex_destroy(&mutex);
+	pthread_cond_destroy(&cond);
+	delete src;
+}
+
+// Queue tile k for decoding, called by the drawing threads
+void Tiles::request(size_t k)
+{
+	pthread_mutex_lock(&mutex);
+	if (state[k] == TILE_ABSENT) {
+		state[k] = TILE_WANTED;
+		queue[nqueue++] = k;
+		pthread_cond_signal(&cond);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+// Free all installed tiles of an image which isn't drawn.
+// Called with mutexTiles locked.
+void Tiles::trim()
+{
+	size_t n = base[levels];
+	pthread_mutex_lock(&mutex);
+	for (size_t k = 0; k < n && bytes > 0; k++) {
+		if (tile[k] != 0) {
+			free(tile[k]);
+			tile[k] = 0;
+			state[k] = TILE_ABSENT;
+			bytes -= tileBytes;
+			totalBytes -= tileBytes;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+struct tile_age {
+	unsigned int age;
+	size_t k;
+};
+
+static int cmp_age(const void *p1, const void *p2)
+{
+	unsigned int a1 = ((const struct tile_age *)p1)->age;
+	unsigned int a2 = ((const struct tile_age *)p2)->age;
+	return a1 < a2 ? -1 : a1 > a2 ? 1 : 0;
+}
+
+void Tiles::frame(float z)
+{
+	// Most reduced level which is still at least as fine as the screen
+	int l = 0;
+	while (l + 1 < levels && (2 << l) <= z)
+		l++;
+	level = l;
+	levelBase = base[l];
+	levelNx = nxl[l];
+	// Only the overview is drawn when it is the level to draw, or when a screen pixel covers
+	// more than half of its pixels: tiles aren't worth decoding then.
+	coarse = l >= ovShift || z >= (float)((ovs / 2) << l);
+	size_t installed = 0;
+	size_t pix = (size_t)3 * nb;
+	pthread_mutex_lock(&mutex);
+	if (ovDecoded) {
+		memcpy(overview, ovDecoded, (size_t)ow * oh * pix);
+		free(ovDecoded);
+		ovDecoded = 0;
+		memset(sampled, 1, (size_t)nx * ny);
+	}
+	for (size_t i = 0; i < ndone; i++) {
+		size_t k = done[i];
+		tile[k] = decoded[k];
+		decoded[k] = 0;
+		used[k] = frameNo;
+		installed++;
+		if (k < (size_t)nx * ny && !sampled[k]) {
+			// Sample the overview pixels falling in the tile
+			int i0 = (int)(k / nx) * th, j0 = (int)(k % nx) * tw;
+			int i1 = i0 + th < h ? i0 + th : h;
+			int j1 = j0 + tw < w ? j0 + tw : w;
+			for (int i = (i0 + ovs - 1) & ~(ovs - 1); i < i1; i += ovs) {
+				unsigned char *o = overview
+				    + pix * ((size_t)(i >> ovShift) * ow + ((j0 + ovs - 1) >> ovShift));
+				for (int j = (j0 + ovs - 1) & ~(ovs - 1); j < j1; j += ovs, o += pix)
+					memcpy(o, tile[k] + pix * ((size_t)(i - i0) * tw + j - j0), pix);
+			}
+			sampled[k] = 1;
+		}
+	}
+	ndone = 0;
+	ready = false;
+	// Tiles still needed will be requested again while drawing
+	for (size_t i = 0; i < nqueue; i++)
+		state[queue[i]] = TILE_ABSENT;
+	nqueue = 0;
+	bytes += installed * tileBytes;
+	pthread_mutex_unlock(&mutex);
+
+	pthread_mutex_lock(&mutexTiles);
+	totalBytes += installed * tileBytes;
+	// Tiles of the other images are older than the ones of this image
+	for (Tiles * t = allTiles; t && totalBytes > budget; t = t->next) {
+		if (t != this)
+			t->trim();
+	}
+	// Tiles drawn by the previous frame are kept even over the budget
+	if (totalBytes > budget && bytes > 0) {
+		size_t n = base[levels];
+		struct tile_age *ages =
+		    (struct tile_age *)malloc(bytes / tileBytes * sizeof(struct tile_age));
+		size_t na = 0;
+		for (size_t k = 0; k < n && ages; k++) {
+			if (tile[k] != 0 && (coarse || used[k] != frameNo)) {
+				ages[na].age = frameNo - used[k];
+				ages[na].k = k;
+				na++;
+			}
+		}
+		// Oldest last
+		qsort(ages, na, sizeof(struct tile_age), cmp_age);
+		for (size_t i = na; i > 0 && totalBytes > budget; i--) {
+			size_t k = ages[i - 1].k;
+			free(tile[k]);
+			tile[k] = 0;
+			state[k] = TILE_ABSENT;
+			bytes -= tileBytes;
+			totalBytes -= tileBytes;
+		}
+		free(ages);
+	}
+	pthread_mutex_unlock(&mutexTiles);
+	frameNo++;
+}
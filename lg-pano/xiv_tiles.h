@@ -0,0 +1,121 @@
+#ifndef _xiv_tiles_h_
+#define _xiv_tiles_h_
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Decodes the tiles of an image, implemented by each tiled format
+class TileSource
+{
+ public:
+  virtual ~TileSource() {}
+  // Decode tile (tx,ty) of level into out, tw x th pixels of 3 samples of nb bytes.
+  // Level l is the image reduced by 2^l, only sources with several levels get l > 0.
+  // worker is the index of the calling thread so that a source can keep per thread handles.
+  virtual bool read(int worker, int level, int tx, int ty, unsigned char* out) = 0;
+  // Decode the whole image reduced by ovs into out, ow x oh pixels.
+  // Only implemented by sources which can do it much faster than by reading every tile.
+  virtual bool overview(int ovs, int ow, int oh, unsigned char* out) { return false; }
+};
+
+// State of a tile
+enum
+  {
+    TILE_ABSENT,
+    TILE_WANTED,      // Queued for decoding
+    TILE_LOADING,     // Being decoded
+    TILE_LOADED,      // Decoded, installed by the next frame
+    TILE_FAILED
+  };
+
+// Tiles of an image decoded on demand by a pool of threads.
+// Decoded tiles of all images share a LRU bounded by Tiles::budget bytes.
+// Tiles are only installed and evicted by frame(), between two frames, so drawing threads
+// read them without locking and only lock to request the missing ones.
+// Every decoded tile is also sampled in an overview which is drawn while tiles are missing,
+// and instead of tiles when the view is zoomed out.
+// Sources with several levels (pyramids) are drawn from the level matching the zoom.
+class Tiles
+{
+ public:
+  Tiles(TileSource* vsrc, int vw, int vh, int vtw, int vth, int vnb, int vlevels, int nthreads);
+  ~Tiles();
+
+  // Pixel (i,j) of the image, or of the overview if its tile isn't decoded yet,
+  // it is then requested.
+  inline const unsigned char* pixel(int i, int j) {
+    if (!coarse) {
+      int li = i >> level, lj = j >> level;
+      int ti = ths >= 0 ? li >> ths : li / th;
+      int tj = tws >= 0 ? lj >> tws : lj / tw;
+      size_t k = levelBase + (size_t)ti * levelNx + tj;
+      unsigned char* t = tile[k];
+      if (t != 0) {
+        used[k] = frameNo;
+        return t + (size_t)3 * nb * ((size_t)(li - ti * th) * tw + lj - tj * tw);
+      }
+      if (state[k] == TILE_ABSENT)
+        request(k);
+    } else {
+      // Tiles not sampled yet in the overview are still wanted
+      size_t k = (size_t)(ths >= 0 ? i >> ths : i / th) * nx + (tws >= 0 ? j >> tws : j / tw);
+      if (!sampled[k] && state[k] == TILE_ABSENT)
+        request(k);
+    }
+    return overview + (size_t)3 * nb * ((size_t)(i >> ovShift) * ow + (j >> ovShift));
+  }
+  void request(size_t k);
+  // To be called before drawing a frame at zoom z (image pixels per screen pixel):
+  // installs decoded tiles, drops the requests which the frame will renew and evicts
+  // the least recently drawn tiles over the budget.
+  void frame(float z);
+  // Free all installed tiles
+  void trim();
+
+  int w, h, tw, th, nx, ny, nb;
+  // Levels of the source, tiles of level l are numbered from base[l], nxl[l] by row
+  int levels;
+  size_t* base;
+  int* nxl;
+  // Level drawn by the current frame
+  int level;
+  size_t levelBase;
+  int levelNx;
+  // Overview is the image reduced by ovs = 2^ovShift, ow x oh pixels
+  int ovs, ovShift, ow, oh;
+  // Set when decoded tiles wait for the next frame
+  volatile bool ready;
+
+  // Bytes of decoded tiles kept for all images
+  static size_t budget;
+
+  // Used by the decoding threads
+  TileSource* src;
+  size_t tileBytes;
+  size_t bytes;
+  bool coarse;                 // Frame is only drawn from the overview
+  unsigned char* overview;
+  unsigned char* ovDecoded;    // Overview from the source, waiting to be installed
+  bool ovWanted;
+  unsigned char** tile;        // Installed tiles
+  unsigned char** decoded;     // Tiles waiting to be installed
+  unsigned int* used;          // Last frame which drew each tile
+  volatile char* state;
+  char* sampled;               // Tile of level 0 was sampled in the overview
+  unsigned int frameNo;
+  int tws, ths;                // log2 of tile size if it's a power of 2, -1 otherwise
+  size_t* queue;               // Requested tiles, the most recent first
+  size_t nqueue;
+  size_t* done;                // Decoded tiles
+  size_t ndone;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t* th_workers;
+  struct tiles_worker* workers;
+  int nworkers;
+  bool quit;
+  // All images with tiles
+  Tiles *prev, *next;
+};
+
+#endif
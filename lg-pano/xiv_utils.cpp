@@ -1,11 +1,16 @@
 #include "xiv_utils.h"
 #include <stdint.h>
-#ifdef HAVE_LIBEXIF
-#include <libexif/exif-data.h>
-#endif
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#ifdef HAVE_LIBLZ4
+#include <lz4.h>
+#endif
 
 int max(int a, int b)
 {
@@ -67,15 +72,19 @@ void compute_histogram(Image * img, int *histr, int *histg, int *histb,
 		return;
 
 	unsigned short *p = (unsigned short *)img->buf;
-	int idx = 0;
-	int n = img->w * img->h;
-	for (int i = 0; i < n; i++) {
+	size_t idx = 0;
+	// Histogram of the raster, which may be reduced or partial
+	size_t n = (size_t)img->bw * img->bh;
+	for (size_t i = 0; i < n; i++) {
 		for (int c = 0; c < 3; c++) {
 			unsigned int val = 0;
 			if (img->nb == 2) {
-				val = (p[idx++] * 255) / img->max;
+				val = (p[idx] * 255) / img->max;
 			} else
-				val = img->buf[idx++];
+				val = img->buf[idx];
+			// The sample of gray pixels counts for the 3 channels
+			if (img->nc == 3 || c == 2)
+				idx++;
 			if (val > 255)
 				val = 255;
 			if (val < 0)
@@ -102,32 +111,6 @@ void compute_histogram(Image * img, int *histr, int *histg, int *histb,
 	}
 }
 
-// Try to retrieve orientation EXIF attributes from the file
-int orientation(const char *file)
-{
-	int val = 0;
-#ifdef HAVE_LIBEXIF
-	ExifData *d = exif_data_new_from_file(file);
-	if (d != NULL) {
-		ExifEntry *e = exif_data_get_entry(d, EXIF_TAG_ORIENTATION);
-		if (e != NULL) {
-			char tmp[1024];
-			exif_entry_get_value(e, tmp, 1024);
-			if (0 == strcmp(tmp, "top - left"))
-				val = 0;
-			else if (0 == strcmp(tmp, "left - bottom"))
-				val = 1;
-			else if (0 == strcmp(tmp, "bottom - right"))
-				val = 2;
-			else if (0 == strcmp(tmp, "right - top"))
-				val = 3;
-		}
-		exif_data_unref(d);
-	}
-#endif
-	return val;
-}
-
 // Test if path is a regular file
 bool is_file(const char *path)
 {
@@ -146,6 +129,176 @@ int cmpstr(const void *p1, const void *p2)
 	return strcmp(*(char **)p1, *(char **)p2);
 }
 
+// Number of cores this process may run on.
+// Uses the affinity mask so that taskset and cgroup cpusets are respected.
+int count_cpus()
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+		return CPU_COUNT(&set);
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+// Parse a cpu list such as "0-3,6" into set, returns false on syntax error.
+bool parse_cpulist(const char *list, cpu_set_t * set)
+{
+	CPU_ZERO(set);
+	const char *p = list;
+	while (*p) {
+		char *end;
+		long first = strtol(p, &end, 10);
+		if (end == p || first < 0 || first >= CPU_SETSIZE)
+			return false;
+		long last = first;
+		p = end;
+		if (*p == '-') {
+			p++;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first || last >= CPU_SETSIZE)
+				return false;
+			p = end;
+		}
+		for (long c = first; c <= last; c++)
+			CPU_SET(c, set);
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return false;
+	}
+	return CPU_COUNT(set) > 0;
+}
+
+// Return the nth cpu of set, wrapping around if n is greater than the number of cpus.
+int nth_cpu(const cpu_set_t * set, int n)
+{
+	int count = CPU_COUNT(set);
+	if (count == 0)
+		return -1;
+	n %= count;
+	for (int c = 0; c < CPU_SETSIZE; c++) {
+		if (CPU_ISSET(c, set) && n-- == 0)
+			return c;
+	}
+	return -1;
+}
+
+// Restrict the calling thread to the cpus in set. An empty set leaves it unchanged.
+void set_thread_cpus(const cpu_set_t * set)
+{
+	if (CPU_COUNT(set) == 0)
+		return;
+	int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), set);
+	if (ret != 0)
+		fprintf(stderr, "Can't set thread affinity: %s\n", strerror(ret));
+}
+
+// Raise the calling thread priority.
+// prio > 0 is a SCHED_FIFO real-time priority, prio < 0 a nice value, 0 does nothing.
+void set_thread_priority(int prio)
+{
+	if (prio > 0) {
+		struct sched_param sp;
+		memset(&sp, 0, sizeof(sp));
+		sp.sched_priority = prio;
+		int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+		if (ret != 0)
+			fprintf(stderr, "Can't set real-time priority %d: %s\n", prio, strerror(ret));
+	} else if (prio < 0) {
+		// On Linux nice values are per thread
+		if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), prio) != 0)
+			fprintf(stderr, "Can't set nice value %d: %s\n", prio, strerror(errno));
+	}
+}
+
+// Make the calling thread yield to rendering and synchronization threads.
+void set_thread_background()
+{
+	struct sched_param sp;
+	memset(&sp, 0, sizeof(sp));
+	pthread_setschedparam(pthread_self(), SCHED_BATCH, &sp);
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+}
+
+// Path of file name of the cgroup (v2) of the process, false if it has none
+static bool cgroup_file(const char *name, char *path, size_t len)
+{
+	FILE *f = fopen("/proc/self/cgroup", "r");
+	if (f == NULL)
+		return false;
+	char line[1024];
+	bool found = false;
+	while (!found && fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "0::", 3) == 0) {
+			line[strcspn(line, "\n")] = 0;
+			// The root cgroup has no limits
+			found = strcmp(line + 3, "/") != 0;
+			if (found)
+				snprintf(path, len, "/sys/fs/cgroup%s/%s", line + 3, name);
+		}
+	}
+	fclose(f);
+	return found;
+}
+
+// Read a size from a cgroup file, false if it can't or if it's unlimited ("max")
+static bool read_cgroup_size(const char *name, size_t &v)
+{
+	char path[1200];
+	if (!cgroup_file(name, path, sizeof(path)))
+		return false;
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return false;
+	unsigned long long n;
+	bool ok = fscanf(f, "%llu", &n) == 1;
+	fclose(f);
+	v = (size_t)n;
+	return ok;
+}
+
+// Percentage of the last 10 seconds some tasks were stalled on memory, read from a
+// pressure stall information file, -1 if there's none
+static float read_pressure(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	float avg = -1;
+	if (fscanf(f, "some avg10=%f", &avg) != 1)
+		avg = -1;
+	fclose(f);
+	return avg;
+}
+
+// Memory the process may use: the RAM, or the limit of its cgroup if it's lower
+size_t memory_limit()
+{
+	size_t ram = (size_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+	size_t max;
+	if (read_cgroup_size("memory.max", max) && max < ram)
+		return max;
+	return ram;
+}
+
+// Whether the process is short of memory: tasks of its cgroup or of the system stalled on
+// memory for more than 10% of the last 10 seconds, or its cgroup is above 90% of its limit.
+bool memory_pressure()
+{
+	char path[1200];
+	float avg = -1;
+	if (cgroup_file("memory.pressure", path, sizeof(path)))
+		avg = read_pressure(path);
+	if (avg < 0)
+		avg = read_pressure("/proc/pressure/memory");
+	if (avg > 10)
+		return true;
+	size_t max, cur;
+	return read_cgroup_size("memory.max", max) && read_cgroup_size("memory.current", cur)
+	    && cur > max / 10 * 9;
+}
+
 void draw_histogram(Image * img, int w, int h, unsigned char *data, int *histr,
 		    int *histg, int *histb, int histMax, int osdSize, int lu,
 		    int cr, int *powv)
@@ -195,3 +348,127 @@ void draw_histogram(Image * img, int w, int h, unsigned char *data, int *histr,
 		}
 	}
 }
+
+// Bands of a packed raster, compressed separately
+#define PACK_BAND (1 << 20)
+
+// Compress len bytes of raster with LZ4 by bands of PACK_BAND bytes.
+// Returns the packed raster, a count of bands and their lengths followed by the bands,
+// 0 if LZ4 isn't available, out of memory or if it would be larger than maxLen.
+unsigned char *pack_raster(const unsigned char *buf, size_t len, size_t maxLen, size_t &packedLen)
+{
+#ifdef HAVE_LIBLZ4
+	uint32_t n = (len + PACK_BAND - 1) / PACK_BAND;
+	size_t head = (n + 1) * sizeof(uint32_t);
+	unsigned char *packed = (unsigned char *)malloc(head + (size_t)n * LZ4_compressBound(PACK_BAND));
+	if (packed == NULL)
+		return 0;
+	uint32_t *lens = (uint32_t *)packed;
+	lens[0] = n;
+	packedLen = head;
+	for (uint32_t b = 0; b < n && packedLen <= maxLen; b++) {
+		int bandLen = len - (size_t)b * PACK_BAND < PACK_BAND ? len - (size_t)b * PACK_BAND : PACK_BAND;
+		int l = LZ4_compress_default((const char *)buf + (size_t)b * PACK_BAND,
+					     (char *)packed + packedLen, bandLen, LZ4_compressBound(PACK_BAND));
+		if (l <= 0) {
+			free(packed);
+			return 0;
+		}
+		lens[b + 1] = l;
+		packedLen += l;
+	}
+	if (packedLen > maxLen) {
+		free(packed);
+		return 0;
+	}
+	unsigned char *shrunk = (unsigned char *)realloc(packed, packedLen);
+	return shrunk ? shrunk : packed;
+#else
+	return 0;
+#endif
+}
+
+// Uncompress a raster of len bytes packed by pack_raster(), returns 0 if out of memory
+unsigned char *unpack_raster(const unsigned char *packed, size_t len)
+{
+#ifdef HAVE_LIBLZ4
+	unsigned char *buf = (unsigned char *)malloc(len);
+	if (buf == NULL)
+		return 0;
+	const uint32_t *lens = (const uint32_t *)packed;
+	uint32_t n = lens[0];
+	const char *p = (const char *)packed + (n + 1) * sizeof(uint32_t);
+	for (uint32_t b = 0; b < n; b++) {
+		int bandLen = len - (size_t)b * PACK_BAND < PACK_BAND ? len - (size_t)b * PACK_BAND : PACK_BAND;
+		if (LZ4_decompress_safe(p, (char *)buf + (size_t)b * PACK_BAND, lens[b + 1], bandLen) != bandLen) {
+			free(buf);
+			return 0;
+		}
+		p += lens[b + 1];
+	}
+	return buf;
+#else
+	return 0;
+#endif
+}
+
+// 8 bits proxy of n samples of 16 bits, of nbits significant bits: the samples as drawn with
+// the default contrast, luminosity and gamma. Returns 0 if out of memory.
+unsigned char *make_proxy(const unsigned short *buf, size_t n, int nbits)
+{
+	unsigned char *proxy = (unsigned char *)malloc(n);
+	unsigned char *lut = (unsigned char *)malloc(65536);
+	if (proxy == NULL || lut == NULL) {
+		free(proxy);
+		free(lut);
+		return 0;
+	}
+	for (int v = 0; v < 65536; v++) {
+		int val = (v * 255) >> nbits;
+		lut[v] = val > 255 ? 255 : val;
+	}
+	for (size_t i = 0; i < n; i++)
+		proxy[i] = lut[buf[i]];
+	free(lut);
+	return proxy;
+}
+
+// Reduce a raster of w x h pixels of nc samples of nb bytes by s, each pixel of the result
+// being the mean of a block of s x s pixels. Returns the (w+s-1)/s x (h+s-1)/s raster, 0 if
+// out of memory.
+unsigned char *reduce_raster(const unsigned char *buf, int w, int h, int nc, int nb, int s)
+{
+	int rw = (w + s - 1) / s, rh = (h + s - 1) / s;
+	unsigned char *out = (unsigned char *)malloc((size_t)rw * rh * nc * nb);
+	unsigned int *sum = (unsigned int *)malloc((size_t)rw * nc * sizeof(unsigned int));
+	if (out == NULL || sum == NULL) {
+		free(out);
+		free(sum);
+		return 0;
+	}
+	for (int ri = 0; ri < rh; ri++) {
+		int rows = (ri + 1) * s <= h ? s : h - ri * s;
+		memset(sum, 0, (size_t)rw * nc * sizeof(unsigned int));
+		for (int i = ri * s; i < ri * s + rows; i++) {
+			size_t k = (size_t)i * w * nc;
+			for (int j = 0; j < w; j++) {
+				unsigned int *o = sum + (size_t)(j / s) * nc;
+				for (int c = 0; c < nc; c++, k++)
+					o[c] += nb == 1 ? buf[k] : ((const unsigned short *)buf)[k];
+			}
+		}
+		for (int rj = 0; rj < rw; rj++) {
+			unsigned int n = rows * ((rj + 1) * s <= w ? s : w - rj * s);
+			size_t k = ((size_t)ri * rw + rj) * nc;
+			for (int c = 0; c < nc; c++) {
+				unsigned int v = sum[(size_t)rj * nc + c] / n;
+				if (nb == 1)
+					out[k + c] = v;
+				else
+					((unsigned short *)out)[k + c] = v;
+			}
+		}
+	}
+	free(sum);
+	return out;
+}
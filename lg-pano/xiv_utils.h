@@ -2,6 +2,7 @@
 #define _xiv_utils_h_
 
 #include "xiv.h"
+#include <sched.h>
 
 void draw_grid(int w, int h, int ncells, unsigned char* data);
 int max(int a,int b);
@@ -9,9 +10,20 @@ int min(int a,int b);
 float max(float a,float b);
 float min(float a,float b);
 void compute_histogram(Image* img, int* histr, int* histg, int* histb, int& histMax);
-int orientation(const char* file);
 bool is_file(const char* path);
 int cmpstr(const void* p1, const void* p2);
+int count_cpus();
+bool parse_cpulist(const char* list, cpu_set_t* set);
+int nth_cpu(const cpu_set_t* set, int n);
+void set_thread_cpus(const cpu_set_t* set);
+void set_thread_priority(int prio);
+void set_thread_background();
+size_t memory_limit();
+bool memory_pressure();
+unsigned char* pack_raster(const unsigned char* buf, size_t len, size_t maxLen, size_t& packedLen);
+unsigned char* unpack_raster(const unsigned char* packed, size_t len);
+unsigned char* make_proxy(const unsigned short* buf, size_t n, int nbits);
+unsigned char* reduce_raster(const unsigned char* buf, int w, int h, int nc, int nb, int s);
 void draw_histogram(Image* img, int w, int h, unsigned char* data, int* histr, int* histg, int* histb, int histMax,int osdSize,int lu, int cr, int* powv);
 
 #endif